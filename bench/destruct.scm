@@ -0,0 +1,43 @@
+;; Destructive list operations: in-place reversal and splicing with
+;; set-car! and set-cdr!.
+
+(load "stdlib.scm")
+
+(define (make-list n)
+  (define (loop i acc)
+    (if (= i 0)
+        acc
+        (loop (- i 1) (cons i acc))))
+  (loop n '()))
+
+(define (reverse! lst)
+  (define (loop lst acc)
+    (if (null? lst)
+        acc
+        (let ((next (cdr lst)))
+          (set-cdr! lst acc)
+          (loop next lst))))
+  (loop lst '()))
+
+(define (last-pair lst)
+  (if (null? (cdr lst))
+      lst
+      (last-pair (cdr lst))))
+
+(define (append! a b)
+  (set-cdr! (last-pair a) b)
+  a)
+
+(define (bump! lst)
+  (if (not (null? lst))
+      (begin (set-car! lst (+ (car lst) 1))
+             (bump! (cdr lst)))))
+
+(define (run n lst)
+  (if (= n 0)
+      (length lst)
+      (let ((half (reverse! lst)))
+        (bump! half)
+        (run (- n 1) (if (= (car half) 0) (append! half (make-list 10)) half)))))
+
+(run 300 (make-list 2000))
@@ -0,0 +1,11 @@
+;; Doubly recursive fibonacci: procedure calls and fixnum arithmetic.
+
+;; bss's < holds when its arguments decrease
+(define (less? a b) (< b a))
+
+(define (fib n)
+  (if (less? n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(fib 27)
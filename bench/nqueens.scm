@@ -0,0 +1,34 @@
+;; Counts the placements of n queens: list building and backtracking.
+
+(load "stdlib.scm")
+
+(define (one-to n)
+  (define (loop i acc)
+    (if (= i 0)
+        acc
+        (loop (- i 1) (cons i acc))))
+  (loop n '()))
+
+(define (ok? row dist placed)
+  (or (null? placed)
+      (and (not (= (car placed) (+ row dist)))
+           (not (= (car placed) (- row dist)))
+           (ok? row (+ dist 1) (cdr placed)))))
+
+(define (try candidates rest placed)
+  (if (null? candidates)
+      (if (null? rest) 1 0)
+      (+ (if (ok? (car candidates) 1 placed)
+             (try (append (cdr candidates) rest) '() (cons (car candidates) placed))
+             0)
+         (try (cdr candidates) (cons (car candidates) rest) placed))))
+
+(define (queens n)
+  (try (one-to n) '() '()))
+
+(define (repeat n thunk)
+  (if (= n 1)
+      (thunk)
+      (begin (thunk) (repeat (- n 1) thunk))))
+
+(repeat 20 (lambda () (queens 8)))
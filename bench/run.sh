@@ -0,0 +1,42 @@
+#!/bin/sh
+# Runs each benchmark in bench/ several times and prints one tab-separated
+# line per benchmark: median wall time, then the allocations and peak RSS
+# that -stats reports for the last run.
+#
+#   sh bench/run.sh [bss binary] [runs]
+#
+# BSS_FLAGS is passed to every run, e.g. BSS_FLAGS="-engine analyze".
+# Benchmarks run from the repository root so that (load "stdlib.scm") and
+# (load "sicp.scm") resolve.
+
+cd "$(dirname "$0")/.." || exit 1
+bss=${1:-./bss}
+runs=${2:-5}
+stats=$(mktemp)
+trap 'rm -f "$stats"' EXIT
+
+printf 'benchmark\truns\tmedian_ms\tobjects\tbytes\tmax_rss_kb\n'
+for file in bench/*.scm; do
+    name=$(basename "$file" .scm)
+    times=
+    i=0
+    while [ "$i" -lt "$runs" ]; do
+        start=$(date +%s%N)
+        if ! "$bss" $BSS_FLAGS -stats -f "$file" > /dev/null 2> "$stats"; then
+            echo "$name: failed" >&2
+            cat "$stats" >&2
+            exit 1
+        fi
+        end=$(date +%s%N)
+        times="$times $(((end - start) / 1000))"
+        i=$((i + 1))
+    done
+    median=$(printf '%s\n' $times | sort -n | awk '
+        { t[NR] = $1 }
+        END { m = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+              printf "%.1f", m / 1000 }')
+    objects=$(awk '$1 == "total" { print $2 }' "$stats")
+    bytes=$(awk '$1 == "total" { print $3 }' "$stats")
+    rss=$(awk '$1 == "max" && $2 == "rss" { print $3 }' "$stats")
+    printf '%s\t%s\t%s\t%s\t%s\t%s\n' "$name" "$runs" "$median" "$objects" "$bytes" "$rss"
+done
@@ -0,0 +1,24 @@
+;; The SICP meta-circular evaluator defining and running procedures that
+;; build and walk lists.
+
+(load "sicp.scm")
+
+(eval-expr '(define (build n acc)
+              (if (= n 0)
+                  acc
+                  (build (- n 1) (cons n acc))))
+           global-env)
+
+(eval-expr '(define (sum lst acc)
+              (if (null? lst)
+                  acc
+                  (sum (cdr lst) (+ acc (car lst)))))
+           global-env)
+
+(eval-expr '(define (run n acc)
+              (if (= n 0)
+                  acc
+                  (run (- n 1) (sum (build 100 '()) acc))))
+           global-env)
+
+(eval-expr '(run 60 0) global-env)
@@ -0,0 +1,13 @@
+;; The SICP meta-circular evaluator running a recursive fibonacci.
+
+(load "sicp.scm")
+
+(eval-expr '(define (fib n)
+              (if (= n 0)
+                  0
+                  (if (= n 1)
+                      1
+                      (+ (fib (- n 1)) (fib (- n 2))))))
+           global-env)
+
+(eval-expr '(fib 16) global-env)
@@ -0,0 +1,30 @@
+;; String comparison: association lists keyed by string literals, looked up
+;; with eq?, which compares string contents.
+
+(define table
+  '(("alpha" . 1) ("bravo" . 2) ("charlie" . 3) ("delta" . 4) ("echo" . 5)
+    ("foxtrot" . 6) ("golf" . 7) ("hotel" . 8) ("india" . 9) ("juliett" . 10)
+    ("kilo" . 11) ("lima" . 12) ("mike" . 13) ("november" . 14) ("oscar" . 15)
+    ("papa" . 16) ("quebec" . 17) ("romeo" . 18) ("sierra" . 19) ("tango" . 20)
+    ("uniform" . 21) ("victor" . 22) ("whiskey" . 23) ("xray" . 24)
+    ("yankee" . 25) ("zulu" . 26)))
+
+(define (lookup key alist)
+  (cond ((null? alist) 0)
+        ((eq? key (car (car alist))) (cdr (car alist)))
+        (else (lookup key (cdr alist)))))
+
+(define keys
+  '("zulu" "alpha" "mike" "yankee" "golf" "sierra" "missing" "echo"))
+
+(define (sum-keys keys total)
+  (if (null? keys)
+      total
+      (sum-keys (cdr keys) (+ total (lookup (car keys) table)))))
+
+(define (run n total)
+  (if (= n 0)
+      total
+      (run (- n 1) (sum-keys keys total))))
+
+(run 20000 0)
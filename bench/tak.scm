@@ -0,0 +1,20 @@
+;; Takeuchi function: deep non-tail recursion with three arguments.
+
+(load "stdlib.scm")
+
+;; bss's < holds when its arguments decrease
+(define (less? a b) (< b a))
+
+(define (tak x y z)
+  (if (not (less? y x))
+      z
+      (tak (tak (- x 1) y z)
+           (tak (- y 1) z x)
+           (tak (- z 1) x y))))
+
+(define (repeat n thunk)
+  (if (= n 1)
+      (thunk)
+      (begin (thunk) (repeat (- n 1) thunk))))
+
+(repeat 10 (lambda () (tak 18 12 6)))
@@ -1,15 +1,29 @@
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "bss.h"
 
-#define BUF_MAX 256
-
 #define caar(x) (car(car(x)))
+#define cdar(x) (cdr(car(x)))
 #define cadr(x) (car(cdr(x)))
 #define cddr(x) (cdr(cdr(x)))
 #define caadr(x) (car(cadr(x)))
@@ -19,192 +33,1077 @@
 #define cdddr(x) (cdr(cddr(x)))
 #define cadddr(x) (car(cdddr(x)))
 
-Object* empty_list;
-Object* global_env;
-Object* true_obj;
-Object* false_obj;
-
-Object* symbols_head;
-Object* quote_symbol;
-Object* define_symbol;
-Object* set_symbol;
-Object* ok_symbol;
-Object* if_symbol;
-Object* lambda_symbol;
-Object* cond_symbol;
-Object* else_symbol;
-Object* apply_symbol;
-Object* let_symbol;
+/* Errors */
+
+// An error ends the process unless the thread has installed an
+// ErrorHandler. Then raise_error cuts the interpreter back to where it was
+// when the handler was installed and longjmps there with the message, so a
+// server or a future can report the error and carry on.
+
+__thread ErrorHandler* error_handler = NULL;
+// the execute engine recurses on the C stack, and reports an overflow once
+// it gets below this address
+__thread char* stack_limit = NULL;
+
+void init_stack_limit() {
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        return;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0 && size > 2 * STACK_MARGIN)
+        stack_limit = (char*)addr + STACK_MARGIN;
+    pthread_attr_destroy(&attr);
+}
+
+// the caller setjmps handler->env next, and removes the handler when the
+// protected code returns normally
+void install_handler(Interp* interp, ErrorHandler* handler) {
+    handler->prev = error_handler;
+    handler->interp = interp;
+    handler->num_roots = interp->gc.num_roots;
+    handler->held = interp->gc.held;
+    handler->sp = interp->vm.sp;
+    handler->num_frames = interp->vm.num_frames;
+    handler->base = interp->vm.base;
+    handler->native_depth = interp->vm.native_depth;
+    handler->compilers = interp->compilers;
+    handler->profile_depth = interp->profiler.depth;
+    handler->depth = interp->counters.depth;
+    handler->message[0] = '\0';
+    error_handler = handler;
+}
+
+void remove_handler(ErrorHandler* handler) {
+    error_handler = handler->prev;
+}
+
+void raise_error(const char* format, ...) {
+    ErrorHandler* handler = error_handler;
+    va_list args;
+    va_start(args, format);
+    if (handler == NULL) {
+        fflush(stdout);
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        exit(1);
+    }
+    vsnprintf(handler->message, ERROR_MESSAGE_MAX, format, args);
+    va_end(args);
+
+    Interp* interp = handler->interp;
+    error_handler = handler->prev;
+    interp->gc.num_roots = handler->num_roots;
+    interp->gc.held = handler->held;
+    interp->vm.sp = handler->sp;
+    interp->vm.num_frames = handler->num_frames;
+    interp->vm.base = handler->base;
+    interp->vm.native_depth = handler->native_depth;
+    if (interp->vm.native_depth == 0 && interp->heap->num_threads == 1)
+        free_discarded(interp->heap);
+    while (interp->compilers != handler->compilers) {
+        free(interp->compilers->instrs);
+        free(interp->compilers->consts);
+        interp->compilers = interp->compilers->parent;
+    }
+    if (interp->profiler.enabled)
+        profile_unwind(interp, handler->profile_depth);
+    interp->counters.depth = handler->depth;
+    longjmp(handler->env, 1);
+}
+
+/* GC */
+
+// The threads of an interpreter share one heap. Each allocates from chunks
+// and free cells of its own, and takes the heap lock only for a new chunk,
+// for the free cells of a swept one, or once it has allocated its
+// allowance. The thread that then finds the heap due for a collection stops
+// the others, each at its next allocation or in a wait it brackets with
+// gc_leave and gc_enter, and collects for all of them.
+
+// kept out of line, so gc_push_root, which runs for nearly every
+// GC_PROTECT, needs no stack frame of its own
+__attribute__((noinline))
+void gc_grow_roots(GCState* gc, Object** root) {
+    gc->roots_capacity = gc->roots_capacity ? gc->roots_capacity * 2 : 256;
+    gc->roots = realloc(gc->roots, gc->roots_capacity * sizeof(Object**));
+    assert(gc->roots != NULL, "out of memory");
+    gc->roots[gc->num_roots++] = root;
+}
+
+void gc_push_root(Interp* interp, Object** root) {
+    GCState* gc = &interp->gc;
+    if (gc->num_roots == gc->roots_capacity) {
+        gc_grow_roots(gc, root);
+        return;
+    }
+    gc->roots[gc->num_roots++] = root;
+}
+
+void gc_mark_push(Interp* interp, Object* object) {
+    Heap* heap = interp->heap;
+    if (object == NULL || is_immediate(object) || object->marked)
+        return;
+
+    object->marked = true;
+    if (heap->mark_top == heap->mark_capacity) {
+        heap->mark_capacity = heap->mark_capacity ? heap->mark_capacity * 2 : 1024;
+        heap->mark_stack = realloc(heap->mark_stack, heap->mark_capacity * sizeof(Object*));
+        assert(heap->mark_stack != NULL, "out of memory");
+    }
+    heap->mark_stack[heap->mark_top++] = object;
+}
+
+// the roots of one thread: its shadow stack, VM stack and frames, and the
+// constants of the compilers under way
+void gc_mark_thread(Interp* interp, Interp* thread) {
+    GCState* gc = &thread->gc;
+    for (size_t i = 0; i < gc->num_roots; i++)
+        gc_mark_push(interp, *gc->roots[i]);
+
+    for (Object** value = thread->vm.stack; value < thread->vm.sp; value++)
+        gc_mark_push(interp, *value);
+    for (size_t i = 0; i < thread->vm.num_frames; i++) {
+        gc_mark_push(interp, thread->vm.frames[i].code);
+        gc_mark_push(interp, thread->vm.frames[i].env);
+    }
+    for (Compiler* c = thread->compilers; c != NULL; c = c->parent) {
+        for (int i = 0; i < c->num_consts; i++)
+            gc_mark_push(interp, c->consts[i]);
+    }
+}
+
+void gc_mark(Interp* interp) {
+    Heap* heap = interp->heap;
+    gc_mark_push(interp, interp->global_env);
+    for (size_t i = 0; i < heap->symbols.capacity; i++)
+        gc_mark_push(interp, heap->symbols.entries[i]);
+    gc_mark_push(interp, interp->quote_symbol);
+    gc_mark_push(interp, interp->define_symbol);
+    gc_mark_push(interp, interp->set_symbol);
+    gc_mark_push(interp, interp->ok_symbol);
+    gc_mark_push(interp, interp->if_symbol);
+    gc_mark_push(interp, interp->lambda_symbol);
+    gc_mark_push(interp, interp->cond_symbol);
+    gc_mark_push(interp, interp->else_symbol);
+    gc_mark_push(interp, interp->apply_symbol);
+    gc_mark_push(interp, interp->let_symbol);
+    gc_mark_push(interp, interp->begin_symbol);
+    gc_mark_push(interp, interp->let_star_symbol);
+    gc_mark_push(interp, interp->letrec_symbol);
+    gc_mark_push(interp, interp->and_symbol);
+    gc_mark_push(interp, interp->or_symbol);
+    gc_mark_push(interp, interp->or_temp_symbol);
+    gc_mark_push(interp, interp->inline_symbol);
+    if (interp->primitive_objects != NULL) {
+        for (Object** p = interp->primitive_objects; *p != NULL; p++)
+            gc_mark_push(interp, *p);
+    }
+
+    for (Interp* thread = heap->threads; thread != NULL; thread = thread->next_thread)
+        gc_mark_thread(interp, thread);
+
+    // queued futures are only held by their deque
+    Pool* pool = &heap->pool;
+    for (int i = 0; pool->started && i < pool->num_workers; i++) {
+        Deque* d = &pool->deques[i];
+        for (size_t j = d->top; j < d->bottom; j++)
+            gc_mark_push(interp, d->futures[j & (d->capacity - 1)]);
+    }
+
+    while (heap->mark_top > 0) {
+        Object* object = heap->mark_stack[--heap->mark_top];
+        switch (object->type) {
+            case TYPE_PAIR:
+                gc_mark_push(interp, object->car);
+                gc_mark_push(interp, object->cdr);
+                break;
+            case TYPE_PROCEDURE:
+                gc_mark_push(interp, object->params);
+                gc_mark_push(interp, object->body);
+                gc_mark_push(interp, object->env);
+                gc_mark_push(interp, object->code);
+                gc_mark_push(interp, object->proc_name);
+                break;
+            case TYPE_CODE:
+                gc_mark_push(interp, object->lambda);
+                for (int i = 0; i < object->num_consts; i++)
+                    gc_mark_push(interp, object->consts[i]);
+                break;
+            case TYPE_NODE:
+                gc_mark_push(interp, object->operand);
+                for (int i = 0; i < object->num_children; i++)
+                    gc_mark_push(interp, object->children[i]);
+                break;
+            case TYPE_SYMBOL:
+                gc_mark_push(interp, object->value);
+                break;
+            case TYPE_FUTURE:
+                gc_mark_push(interp, object->thunk);
+                gc_mark_push(interp, object->future_value);
+                break;
+            case TYPE_LOCALREF:
+            case TYPE_GLOBALREF:
+                gc_mark_push(interp, object->name);
+                break;
+            case TYPE_FRAME:
+                gc_mark_push(interp, object->parent);
+                gc_mark_push(interp, object->vars);
+                gc_mark_push(interp, object->overflow);
+                for (int i = 0; i < object->num_slots; i++)
+                    gc_mark_push(interp, object->slots[i]);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void free_chunk(Heap* heap, Chunk* chunk) {
+    heap->num_chunks--;
+    heap->bytes_reserved -= chunk->limit - (char*)chunk;
+    free(chunk);
+}
+
+// whether some thread is bump allocating from chunk, which keeps it even
+// when nothing in it is live
+bool chunk_current(Heap* heap, Chunk* chunk) {
+    if (chunk->size_class == LARGE_SIZE_CLASS)
+        return false;
+    for (Interp* thread = heap->threads; thread != NULL; thread = thread->next_thread) {
+        if (thread->gc.current[chunk->size_class] == chunk)
+            return true;
+    }
+    return false;
+}
+
+void gc_sweep(Interp* interp) {
+    Heap* heap = interp->heap;
+    Chunk** link = &heap->chunks;
+    heap->bytes_live = 0;
+    heap->num_objects = 0;
+
+    // every free cell goes back on a partial list, including those threads
+    // had taken and not used
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+        heap->partial[i] = NULL;
+    for (Interp* thread = heap->threads; thread != NULL; thread = thread->next_thread) {
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            thread->gc.partial[i] = NULL;
+            thread->gc.free_lists[i] = NULL;
+        }
+    }
+
+    while (*link != NULL) {
+        Chunk* chunk = *link;
+        Object* free_cells = NULL;
+        size_t num_free = 0;
+        chunk->live_cells = 0;
+
+        for (char* cell = chunk->cells; cell < chunk->bump; cell += chunk->cell_size) {
+            Object* object = (Object*)cell;
+            if (object->marked) {
+                object->marked = false;
+                chunk->live_cells++;
+                continue;
+            }
+
+            if (object->type == TYPE_STRING) {
+                free(object->str_val);
+            } else if (object->type == TYPE_CODE) {
+                free(object->instrs);
+                free(object->consts);
+                free(object->caches);
+                if (object->native != NULL)
+                    free_native(object->native);
+            } else if (object->type == TYPE_FUTURE) {
+                free(object->error);
+            }
+            object->type = TYPE_FREE;
+            object->car = free_cells;
+            free_cells = object;
+            num_free++;
+        }
+
+        heap->num_objects += chunk->live_cells;
+        heap->bytes_live += chunk->live_cells * chunk->cell_size;
+
+        // hand empty chunks back unless they are still being bump allocated
+        if (chunk->live_cells == 0 && !chunk_current(heap, chunk)) {
+            *link = chunk->next;
+            free_chunk(heap, chunk);
+            continue;
+        }
+
+        chunk->free_cells = NULL;
+        if (free_cells != NULL && chunk->size_class != LARGE_SIZE_CLASS) {
+            chunk->free_cells = free_cells;
+            chunk->num_free = num_free;
+            chunk->next_partial = heap->partial[chunk->size_class];
+            heap->partial[chunk->size_class] = chunk;
+        }
+        link = &chunk->next;
+    }
+
+    for (Interp* thread = heap->threads; thread != NULL; thread = thread->next_thread) {
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+            thread->gc.swept[i] = heap->partial[i] != NULL;
+    }
+}
+
+// collects with the heap lock held and every other thread stopped, and
+// returns whether the live data fits under the heap limit
+bool gc_collect(Interp* interp) {
+    Heap* heap = interp->heap;
+    gc_mark(interp);
+    gc_sweep(interp);
+    heap->collections++;
+    heap->bytes_allocated = 0;
+    if (heap->bytes_live > heap->max_live_bytes)
+        heap->max_live_bytes = heap->bytes_live;
+
+    // let the heap grow with the live set so collections stay proportional;
+    // a trigger of 0 collects at every allocation, to find unrooted objects
+    if (heap->trigger == 0)
+        heap->next_collection = 0;
+    else
+        heap->next_collection = heap->bytes_live > heap->trigger ? heap->bytes_live : heap->trigger;
+
+    // no run can be in discarded native code once no thread is in any
+    bool native = false;
+    for (Interp* thread = heap->threads; thread != NULL; thread = thread->next_thread)
+        native |= thread->vm.native_depth > 0;
+    if (!native)
+        free_discarded(heap);
+
+    return !heap->heap_max || heap->bytes_live <= heap->heap_max;
+}
+
+// with the heap lock held: a thread stopped for a collection waits here,
+// not counted as running, until the collector resumes the others
+void gc_park(Interp* interp) {
+    Heap* heap = interp->heap;
+    heap->running--;
+    pthread_cond_signal(&heap->stopped);
+    while (heap->stopping)
+        pthread_cond_wait(&heap->resumed, &heap->lock);
+    heap->running++;
+}
+
+// with the heap lock held: asks the other threads to park, by running out
+// their allowance, and waits until they have or are blocked
+void gc_stop_world(Interp* interp) {
+    Heap* heap = interp->heap;
+    heap->stopping = true;
+    for (Interp* thread = heap->threads; thread != NULL; thread = thread->next_thread) {
+        if (thread != interp)
+            __atomic_store_n(&thread->gc.allowance, 0, __ATOMIC_RELAXED);
+    }
+    while (heap->running > 1)
+        pthread_cond_wait(&heap->stopped, &heap->lock);
+}
+
+void gc_resume_world(Heap* heap) {
+    heap->stopping = false;
+    pthread_cond_broadcast(&heap->resumed);
+}
+
+// takes the heap lock to change the chunk lists, parking first if a
+// collection is waiting for this thread
+void gc_lock(Interp* interp) {
+    Heap* heap = interp->heap;
+    pthread_mutex_lock(&heap->lock);
+    while (heap->stopping && interp->gc.held == 0)
+        gc_park(interp);
+}
+
+// the allocation slow path, once a thread has allocated its allowance: its
+// bytes go into the heap's count, and it collects if that makes the heap
+// due, or parks while another thread collects. Alone in the heap a thread
+// may allocate all that is left before the next collection, else a slice.
+void gc_poll(Interp* interp) {
+    GCState* gc = &interp->gc;
+    Heap* heap = interp->heap;
+    if (gc->held > 0)
+        return;
+
+    pthread_mutex_lock(&heap->lock);
+    heap->bytes_allocated += gc->bytes_allocated;
+    gc->bytes_allocated = 0;
+    bool fits = true;
+    if (heap->stopping) {
+        gc_park(interp);
+    } else if (heap->bytes_allocated >= heap->next_collection) {
+        gc_stop_world(interp);
+        fits = gc_collect(interp);
+        gc_resume_world(heap);
+    }
+    size_t allowance = heap->next_collection > heap->bytes_allocated
+                       ? heap->next_collection - heap->bytes_allocated : 0;
+    if (heap->num_threads > 1 && allowance > GC_ALLOWANCE_SLICE)
+        allowance = GC_ALLOWANCE_SLICE;
+    __atomic_store_n(&gc->allowance, allowance, __ATOMIC_RELAXED);
+    bool shut_down = interp->worker >= 0 && heap->pool.shutdown;
+    pthread_mutex_unlock(&heap->lock);
+
+    if (!fits) {
+        raise_error("heap exhausted: %zu bytes live, limit is %zu",
+                    heap->bytes_live, heap->heap_max);
+    }
+    if (shut_down)
+        raise_error("interpreter shut down");
+}
+
+// holds off collections while this thread keeps new objects unrooted, as
+// when reading an image; nests, and must not span a wait. A collection
+// due meanwhile comes at the next allocation after the release, so the
+// caller can still root what it read.
+void gc_hold(Interp* interp) {
+    interp->gc.held++;
+}
+
+void gc_release(Interp* interp) {
+    interp->gc.held--;
+}
+
+// a thread about to block leaves the running count, so collections need
+// not wait for it; its roots must not change until gc_enter
+void gc_leave(Interp* interp) {
+    Heap* heap = interp->heap;
+    pthread_mutex_lock(&heap->lock);
+    heap->running--;
+    pthread_cond_signal(&heap->stopped);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+void gc_enter(Interp* interp) {
+    Heap* heap = interp->heap;
+    pthread_mutex_lock(&heap->lock);
+    while (heap->stopping)
+        pthread_cond_wait(&heap->resumed, &heap->lock);
+    heap->running++;
+    pthread_mutex_unlock(&heap->lock);
+}
+
+void heap_report(Interp* interp, FILE* stream) {
+    Heap* heap = interp->heap;
+    fprintf(stream, "%-18s %6s %10s %10s %10s %6s\n",
+            "chunk", "cell", "cells", "used", "reserved", "use%");
+    for (Chunk* chunk = heap->chunks; chunk != NULL; chunk = chunk->next) {
+        size_t reserved = chunk->limit - chunk->cells;
+        size_t capacity = reserved / chunk->cell_size;
+        size_t used = 0;
+        for (char* cell = chunk->cells; cell < chunk->bump; cell += chunk->cell_size) {
+            if (((Object*)cell)->type != TYPE_FREE)
+                used++;
+        }
+        fprintf(stream, "%-18p %6zu %4zu/%-5zu %10zu %10zu %5.1f%%\n",
+                (void*)chunk, chunk->cell_size, used, capacity,
+                used * chunk->cell_size, reserved,
+                100.0 * used * chunk->cell_size / reserved);
+    }
+    fprintf(stream, "%zu chunks, %zu bytes reserved, %zu objects\n",
+            heap->num_chunks, heap->bytes_reserved, heap->num_objects);
+}
+
+// lower case name of an object type, as used in reports
+void type_label(ObjectType type, char* buf, size_t len) {
+    const char* name = type_names[type] + strlen("TYPE_");
+    size_t i = 0;
+    for (; name[i] != '\0' && i < len - 1; i++)
+        buf[i] = tolower((unsigned char)name[i]);
+    buf[i] = '\0';
+}
+
+void stats_report(Interp* interp, FILE* stream) {
+    Heap* heap = interp->heap;
+    RuntimeStats* counters = &interp->counters;
+    size_t total = 0;
+    size_t total_bytes = 0;
+    fprintf(stream, "%-12s %12s %14s\n", "allocated", "objects", "bytes");
+    for (int t = 0; t < TYPE_FREE; t++) {
+        if (counters->allocations[t] == 0)
+            continue;
+        char label[32];
+        type_label(t, label, sizeof(label));
+        fprintf(stream, "%-12s %12zu %14zu\n", label,
+                counters->allocations[t], counters->allocated_bytes[t]);
+        total += counters->allocations[t];
+        total_bytes += counters->allocated_bytes[t];
+    }
+    fprintf(stream, "%-12s %12zu %14zu\n", "total", total, total_bytes);
+    fprintf(stream, "frames %zu, argument lists %zu\n",
+            counters->allocations[TYPE_FRAME], counters->argument_lists);
+    fprintf(stream, "evals %zu, calls %zu, primitive calls %zu, max depth %zu\n",
+            counters->evals, counters->calls, counters->primitive_calls, counters->max_depth);
+    fprintf(stream, "native compiles %zu, deopts %zu\n", counters->native_compiles, counters->deopts);
+    fprintf(stream, "collections %zu, live bytes after the last %zu (max %zu), reserved bytes %zu in %zu chunks\n",
+            heap->collections, heap->bytes_live, heap->max_live_bytes,
+            heap->bytes_reserved, heap->num_chunks);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        fprintf(stream, "max rss %ld kB\n", usage.ru_maxrss);
+}
+
+/* Allocation */
+
+const size_t object_sizes[] = {
+    [TYPE_STRING] = offsetof(Object, str_val) + sizeof(char*),
+    [TYPE_SYMBOL] = offsetof(Object, value) + sizeof(Object*),
+    [TYPE_PAIR] = offsetof(Object, cdr) + sizeof(Object*),
+    [TYPE_PRIMITIVE] = offsetof(Object, prim_name) + sizeof(char*),
+    [TYPE_PROCEDURE] = offsetof(Object, frame_size) + sizeof(int),
+    [TYPE_CODE] = offsetof(Object, native) + sizeof(NativeCode*),
+    [TYPE_LOCALREF] = offsetof(Object, index) + sizeof(int),
+    [TYPE_GLOBALREF] = offsetof(Object, index) + sizeof(int),
+    [TYPE_FUTURE] = offsetof(Object, task_kind) + sizeof(int),
+};
+
+int size_class_for(size_t size) {
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        if (size <= size_classes[i])
+            return i;
+    }
+    return LARGE_SIZE_CLASS;
+}
+
+Chunk* new_chunk(Interp* interp, int size_class, size_t cell_size) {
+    Heap* heap = interp->heap;
+    // cells start on a cache line, so a 64 byte cell never straddles two
+    size_t header = (sizeof(Chunk) + CHUNK_ALIGN - 1) & ~(size_t)(CHUNK_ALIGN - 1);
+    size_t size = size_class == LARGE_SIZE_CLASS ? header + cell_size : CHUNK_SIZE;
+
+    Chunk* chunk;
+    assert(posix_memalign((void**)&chunk, CHUNK_ALIGN, size) == 0, "out of memory");
+    chunk->next_partial = NULL;
+    chunk->free_cells = NULL;
+    chunk->size_class = size_class;
+    chunk->cell_size = cell_size;
+    chunk->live_cells = 0;
+    chunk->cells = (char*)chunk + header;
+    chunk->bump = chunk->cells;
+    chunk->limit = (char*)chunk + size;
+
+    gc_lock(interp);
+    chunk->next = heap->chunks;
+    heap->chunks = chunk;
+    heap->num_chunks++;
+    heap->bytes_reserved += size;
+    pthread_mutex_unlock(&heap->lock);
+    return chunk;
+}
+
+// makes the free cells of the thread's next swept chunk of the size class
+// its free list. When it has none left it takes swept chunks from the heap,
+// about a chunk's worth of cells at a time, as one may hold only a few.
+void take_partial(Interp* interp, int size_class) {
+    GCState* gc = &interp->gc;
+    Heap* heap = interp->heap;
+    if (gc->partial[size_class] == NULL) {
+        gc_lock(interp);
+        size_t wanted = CHUNK_SIZE / size_classes[size_class];
+        size_t taken = 0;
+        while (taken < wanted && heap->partial[size_class] != NULL) {
+            Chunk* chunk = heap->partial[size_class];
+            heap->partial[size_class] = chunk->next_partial;
+            chunk->next_partial = gc->partial[size_class];
+            gc->partial[size_class] = chunk;
+            taken += chunk->num_free;
+        }
+        gc->swept[size_class] = heap->partial[size_class] != NULL;
+        pthread_mutex_unlock(&heap->lock);
+    }
+
+    Chunk* chunk = gc->partial[size_class];
+    if (chunk != NULL) {
+        gc->partial[size_class] = chunk->next_partial;
+        gc->free_lists[size_class] = chunk->free_cells;
+        chunk->free_cells = NULL;
+    }
+}
+
+Object* allocate(Interp* interp, ObjectType type, size_t size) {
+    GCState* gc = &interp->gc;
+    if (gc->bytes_allocated >= __atomic_load_n(&gc->allowance, __ATOMIC_RELAXED))
+        gc_poll(interp);
+
+    int size_class = size_class_for(size);
+    Object* object;
+
+    if (size_class == LARGE_SIZE_CLASS) {
+        size = (size + 15) & ~(size_t)15;
+        Chunk* chunk = new_chunk(interp, size_class, size);
+        object = (Object*)chunk->bump;
+        chunk->bump += size;
+    } else {
+        size = size_classes[size_class];
+        // the free cells of swept chunks go before fresh ones
+        if (gc->free_lists[size_class] == NULL &&
+            (gc->partial[size_class] != NULL || gc->swept[size_class]))
+            take_partial(interp, size_class);
+        object = gc->free_lists[size_class];
+        if (object != NULL) {
+            gc->free_lists[size_class] = object->car;
+        } else {
+            Chunk* chunk = gc->current[size_class];
+            if (chunk == NULL || chunk->bump + size > chunk->limit) {
+                chunk = new_chunk(interp, size_class, size);
+                gc->current[size_class] = chunk;
+            }
+            object = (Object*)chunk->bump;
+            chunk->bump += size;
+        }
+    }
+
+    object->type = type;
+    object->marked = false;
+    object->form = FORM_NONE;
+    gc->bytes_allocated += size;
+    interp->counters.allocations[type]++;
+    interp->counters.allocated_bytes[type] += size;
+    return object;
+}
 
 /* Object */
 
 ObjectType type(Object* object) {
+    if (is_fixnum(object))
+        return TYPE_INT;
+    if (is_immediate(object))
+        return object == empty_list ? TYPE_EMPTYLIST : TYPE_BOOL;
     return object->type;
 }
 
-Object* new_object(ObjectType type) {
-    Object* object = malloc(sizeof(Object));
-    object->type = type;
-    return object;
+Object* new_object(Interp* interp, ObjectType type) {
+    return allocate(interp, type, object_sizes[type]);
 }
 
-Object* cons(Object* car, Object* cdr) {
-    Object* object = new_object(TYPE_PAIR);
+Object* cons(Interp* interp, Object* car, Object* cdr) {
+    GC_PROTECT(car);
+    GC_PROTECT(cdr);
+    Object* object = new_object(interp, TYPE_PAIR);
+    GC_UNPROTECT(2);
     object->car = car;
     object->cdr = cdr;
     return object;
 }
 
 Object* car(Object* pair) {
+    if (is_immediate(pair) || pair->type != TYPE_PAIR)
+        raise_error("car expected pair");
     return pair->car;
 }
 
 Object* cdr(Object* pair) {
+    if (is_immediate(pair) || pair->type != TYPE_PAIR)
+        raise_error("cdr expected pair");
     return pair->cdr;
 }
 
 Object* new_int(int val) {
-    Object* object = new_object(TYPE_INT);
-    object->int_val = val;
-    return object;
+    return make_fixnum(val);
 }
 
-Object* new_string(char* str) {
-    Object* object = new_object(TYPE_STRING);
+Object* new_string(Interp* interp, char* str) {
+    Object* object = new_object(interp, TYPE_STRING);
     object->str_val = str;
     return object;
 }
 
-Object* new_symbol(char* str) {
-    // create object for the symbol
-    Object* symbol = new_object(TYPE_SYMBOL);
-    symbol->str_val = str;
+uint32_t hash_string(const char* str, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    // add to head of symbol list
-    Object* entry = cons(symbol, symbols_head);
-    symbols_head = entry;
-    return symbol;
+void grow_symbol_table(SymbolTable* symbols) {
+    size_t capacity = symbols->capacity ? symbols->capacity * 2 : SYMBOL_TABLE_MIN_CAPACITY;
+    Object** entries = calloc(capacity, sizeof(Object*));
+    assert(entries != NULL, "out of memory");
+
+    // reinsert using the stored hashes, the names are never rehashed
+    for (size_t i = 0; i < symbols->capacity; i++) {
+        Object* symbol = symbols->entries[i];
+        if (symbol == NULL)
+            continue;
+
+        size_t slot = symbol->hash & (capacity - 1);
+        while (entries[slot] != NULL)
+            slot = (slot + 1) & (capacity - 1);
+        entries[slot] = symbol;
+    }
+
+    free(symbols->entries);
+    symbols->entries = entries;
+    symbols->capacity = capacity;
 }
 
-Object* get_symbol(char* name) {
-    Object* sym = symbols_head;
-    while (sym != empty_list) {
-        char* entry = car(sym)->str_val;
-        if (strcmp(entry, name) == 0) {
-            return car(sym);
-        }
-        sym = cdr(sym);
+Object* find_symbol(SymbolTable* symbols, const char* name, size_t len, uint32_t hash) {
+    if (symbols->capacity == 0)
+        return NULL;
+    size_t mask = symbols->capacity - 1;
+    size_t slot = hash & mask;
+    for (Object* symbol = symbols->entries[slot];
+         symbol != NULL;
+         symbol = symbols->entries[slot = (slot + 1) & mask]) {
+        if (symbol->hash == hash &&
+            !memcmp(symbol->str_val, name, len) &&
+            symbol->str_val[len] == '\0')
+            return symbol;
     }
     return NULL;
 }
 
-Object* new_primitive(Object* (*func)(Object*)) {
-    Object* primitive = new_object(TYPE_PRIMITIVE);
-    primitive->func = func;
+// the table is shared by the threads of the heap, and its lock is not held
+// while allocating, so another thread may intern the same name meanwhile;
+// the symbol that loses is left to the sweep as a string
+Object* intern_symbol(Interp* interp, const char* name, size_t len) {
+    Heap* heap = interp->heap;
+    SymbolTable* symbols = &heap->symbols;
+    uint32_t hash = hash_string(name, len);
+
+    pthread_mutex_lock(&heap->symbols_lock);
+    Object* symbol = find_symbol(symbols, name, len, hash);
+    pthread_mutex_unlock(&heap->symbols_lock);
+    if (symbol != NULL)
+        return symbol;
+
+    char* str = malloc(len + 1);
+    assert(str != NULL, "out of memory");
+    memcpy(str, name, len);
+    str[len] = '\0';
+
+    symbol = new_object(interp, TYPE_SYMBOL);
+    symbol->str_val = str;
+    symbol->hash = hash;
+    symbol->value = unbound_obj;
+
+    pthread_mutex_lock(&heap->symbols_lock);
+    Object* found = find_symbol(symbols, name, len, hash);
+    if (found == NULL) {
+        // keep the load factor at or below one half
+        if ((symbols->count + 1) * 2 > symbols->capacity)
+            grow_symbol_table(symbols);
+        size_t slot = hash & (symbols->capacity - 1);
+        while (symbols->entries[slot] != NULL)
+            slot = (slot + 1) & (symbols->capacity - 1);
+        symbols->entries[slot] = symbol;
+        symbols->count++;
+    } else {
+        symbol->type = TYPE_STRING;
+        symbol = found;
+    }
+    pthread_mutex_unlock(&heap->symbols_lock);
+    return symbol;
+}
+
+Object* new_symbol(Interp* interp, char* name) {
+    return intern_symbol(interp, name, strlen(name));
+}
+
+Object* new_special_form(Interp* interp, char* name, SpecialForm form) {
+    Object* symbol = new_symbol(interp, name);
+    symbol->form = form;
+    return symbol;
+}
+
+// a symbol left out of the symbol table, so no program text can name it;
+// name must outlive the interpreter
+Object* new_hidden_symbol(Interp* interp, char* name, SpecialForm form) {
+    Object* symbol = new_object(interp, TYPE_SYMBOL);
+    symbol->str_val = name;
+    symbol->hash = hash_string(name, strlen(name));
+    symbol->value = unbound_obj;
+    symbol->form = form;
+    return symbol;
+}
+
+Object* new_primitive(Interp* interp, const PrimitiveDef* def) {
+    Object* primitive = new_object(interp, TYPE_PRIMITIVE);
+    primitive->func = def->func;
+    primitive->min_args = def->min_args;
+    primitive->max_args = def->max_args;
+    primitive->prim_name = def->name;
     return primitive;
 }
 
-Object* new_procedure(Object* params, Object* body, Object* env) {
-    Object* proc = new_object(TYPE_PROCEDURE);
+Object* new_local_ref(Interp* interp, Object* name, int depth, int index) {
+    GC_PROTECT(name);
+    Object* ref = new_object(interp, TYPE_LOCALREF);
+    ref->name = name;
+    ref->depth = depth;
+    ref->index = index;
+    GC_UNPROTECT(1);
+    return ref;
+}
+
+Object* new_global_ref(Interp* interp, Object* name) {
+    GC_PROTECT(name);
+    Object* ref = new_object(interp, TYPE_GLOBALREF);
+    ref->name = name;
+    ref->depth = 0;
+    ref->index = 0;
+    GC_UNPROTECT(1);
+    return ref;
+}
+
+Object* new_procedure(Interp* interp, Object* params, Object* body, Object* env) {
+    GC_PROTECT(params);
+    GC_PROTECT(body);
+    GC_PROTECT(env);
+    Object* proc = new_object(interp, TYPE_PROCEDURE);
     proc->params = params;
     proc->body = body;
     proc->env = env;
+    proc->code = NULL;
+    proc->proc_name = NULL;
+    proc->frame_size = 0;
+    for (Object* p = params; type(p) == TYPE_PAIR; p = cdr(p))
+        proc->frame_size++;
+    GC_UNPROTECT(3);
     return proc;
 }
 
-Object* _proc_add(Object* args) {
-    int result = 0;
+// a procedure is named after the first variable it is defined as
+void name_procedure(Object* value, Object* name) {
+    if (type(value) == TYPE_PROCEDURE && value->proc_name == NULL)
+        value->proc_name = name;
+}
 
-    while (args != empty_list) {
-        Object* obj = car(args);
-        assert(type(obj) == TYPE_INT, "expected TYPE_INT");
+/* Profile */
 
-        result += obj->int_val;
-        args = cdr(args);
+// With -profile, every procedure call is timed on a shadow stack. Engines
+// record the profiler depth with each of their frames and unwind to it when
+// the frame returns or is replaced by a tail call, so the shadow stack
+// matches the frames that are actually live.
+
+uint64_t profile_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const char* procedure_label(Object* proc) {
+    if (type(proc) == TYPE_PRIMITIVE)
+        return proc->prim_name;
+    return proc->proc_name ? proc->proc_name->str_val : "lambda";
+}
+
+void profile_enter(Interp* interp, Object* proc) {
+    Profiler* profiler = &interp->profiler;
+    ProfileNode* parent = profiler->depth ? profiler->stack[profiler->depth - 1].node
+                                         : &profiler->root;
+    const char* label = procedure_label(proc);
+
+    ProfileNode* node = parent->children;
+    while (node != NULL && node->label != label)
+        node = node->next;
+    if (node == NULL) {
+        node = calloc(1, sizeof(ProfileNode));
+        assert(node != NULL, "out of memory");
+        node->label = label;
+        node->parent = parent;
+        node->next = parent->children;
+        parent->children = node;
     }
-    return new_int(result);
+    node->calls++;
+
+    if (profiler->depth == profiler->capacity) {
+        profiler->capacity = profiler->capacity ? profiler->capacity * 2 : 1024;
+        profiler->stack = realloc(profiler->stack, profiler->capacity * sizeof(ProfileEntry));
+        assert(profiler->stack != NULL, "out of memory");
+    }
+    profiler->stack[profiler->depth++] = (ProfileEntry){node, profile_now(), 0};
 }
 
-Object* _proc_sub(Object* args) {
-    Object* obj = car(args);
-    int result = obj->int_val;
-    args = cdr(args);
+void profile_exit(Interp* interp) {
+    Profiler* profiler = &interp->profiler;
+    ProfileEntry* entry = &profiler->stack[--profiler->depth];
+    uint64_t elapsed = profile_now() - entry->start_ns;
+    entry->node->exclusive_ns += elapsed - entry->child_ns;
+    if (profiler->depth)
+        profiler->stack[profiler->depth - 1].child_ns += elapsed;
+}
 
-    while (args != empty_list) {
-        obj = car(args);
-        assert(type(obj) == TYPE_INT, "expected TYPE_INT");
+void profile_unwind(Interp* interp, size_t depth) {
+    while (interp->profiler.depth > depth)
+        profile_exit(interp);
+}
 
-        result -= obj->int_val;
-        args = cdr(args);
+void profile_write_stack(Interp* interp, FILE* file, ProfileNode* node) {
+    if (node->parent != &interp->profiler.root) {
+        profile_write_stack(interp, file, node->parent);
+        fputc(';', file);
     }
-    return new_int(result);
+    fputs(node->label, file);
 }
 
-Object* _proc_mul(Object* args) {
-    int result = 1;
+int profile_compare(const void* a, const void* b) {
+    const ProfileStat* x = a;
+    const ProfileStat* y = b;
+    return x->exclusive_ns < y->exclusive_ns ? 1 : x->exclusive_ns > y->exclusive_ns ? -1 : 0;
+}
 
-    while (args != empty_list) {
-        Object* obj = car(args);
-        assert(type(obj) == TYPE_INT, "expected TYPE_INT");
+// writes the folded stacks, weighted by exclusive microseconds, to the
+// profile file and a table of calls and times per procedure to stderr
+void profile_report(Interp* interp) {
+    Profiler* profiler = &interp->profiler;
+    profile_unwind(interp, 0);
+    FILE* file = fopen(profiler->filename, "w");
+    if (file == NULL) {
+        fprintf(stderr, "could not open file: %s\n", profiler->filename);
+        exit(1);
+    }
 
-        result *= obj->int_val;
-        args = cdr(args);
+    ProfileStat* stats = NULL;
+    size_t num_stats = 0;
+
+    // walk the tree through the parent links, so deep recursion needs no
+    // stack here either
+    ProfileNode* node = profiler->root.children;
+    while (node != NULL) {
+        ProfileStat* stat = NULL;
+        for (size_t i = 0; i < num_stats && stat == NULL; i++) {
+            if (stats[i].label == node->label)
+                stat = &stats[i];
+        }
+        if (stat == NULL) {
+            stats = realloc(stats, (num_stats + 1) * sizeof(ProfileStat));
+            assert(stats != NULL, "out of memory");
+            stat = &stats[num_stats++];
+            *stat = (ProfileStat){node->label, 0, 0, 0, 0};
+        }
+        stat->calls += node->calls;
+        stat->exclusive_ns += node->exclusive_ns;
+        node->outermost = stat->active++ == 0;
+        node->total_ns = node->exclusive_ns;
+
+        if (node->exclusive_ns / 1000 > 0) {
+            profile_write_stack(interp, file, node);
+            fprintf(file, " %llu\n", (unsigned long long)(node->exclusive_ns / 1000));
+        }
+
+        if (node->children != NULL) {
+            node = node->children;
+            continue;
+        }
+        while (node != NULL) {
+            for (size_t i = 0; i < num_stats; i++) {
+                if (stats[i].label != node->label)
+                    continue;
+                stats[i].active--;
+                if (node->outermost)
+                    stats[i].inclusive_ns += node->total_ns;
+            }
+            node->parent->total_ns += node->total_ns;
+            if (node->next != NULL) {
+                node = node->next;
+                break;
+            }
+            node = node->parent == &profiler->root ? NULL : node->parent;
+        }
+    }
+    fclose(file);
+
+    qsort(stats, num_stats, sizeof(ProfileStat), profile_compare);
+    fprintf(stderr, "%-24s %10s %14s %14s\n", "procedure", "calls", "inclusive ms", "exclusive ms");
+    for (size_t i = 0; i < num_stats; i++) {
+        fprintf(stderr, "%-24s %10llu %14.3f %14.3f\n", stats[i].label,
+                (unsigned long long)stats[i].calls,
+                stats[i].inclusive_ns / 1e6, stats[i].exclusive_ns / 1e6);
+    }
+    free(stats);
+}
+
+// frees the calling context tree below root, through the parent links
+void profile_free(ProfileNode* root) {
+    ProfileNode* node = root->children;
+    while (node != NULL) {
+        if (node->children != NULL) {
+            node = node->children;
+            continue;
+        }
+        ProfileNode* parent = node->parent;
+        parent->children = node->next;
+        free(node);
+        node = parent == root ? root->children : parent;
     }
+}
 
+Object* _proc_add(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    int result = 0;
+
+    for (int i = 0; i < argc; i++) {
+        assert(type(argv[i]) == TYPE_INT, "expected TYPE_INT");
+        result += fixnum_val(argv[i]);
+    }
     return new_int(result);
 }
 
-Object* _proc_div(Object* args) {
-    Object* obj = car(args);
-    assert(type(obj) == TYPE_INT, "expected TYPE_INT");
+Object* _proc_sub(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    int result = fixnum_val(argv[0]);
 
-    int result = obj->int_val;
-    args = cdr(args);
+    for (int i = 1; i < argc; i++) {
+        assert(type(argv[i]) == TYPE_INT, "expected TYPE_INT");
+        result -= fixnum_val(argv[i]);
+    }
+    return new_int(result);
+}
 
-    while (args != empty_list) {
-        obj = car(args);
-        assert(type(obj) == TYPE_INT, "expected TYPE_INT");
+Object* _proc_mul(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    int result = 1;
 
-        result /= obj->int_val;
-        args = cdr(args);
+    for (int i = 0; i < argc; i++) {
+        assert(type(argv[i]) == TYPE_INT, "expected TYPE_INT");
+        result *= fixnum_val(argv[i]);
     }
+
     return new_int(result);
 }
 
-Object* _proc_equals(Object* args) {
-    Object* obj = car(args);
-    assert(type(obj) == TYPE_INT, "expected TYPE_INT");
+Object* _proc_div(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    assert(type(argv[0]) == TYPE_INT, "expected TYPE_INT");
+    int result = fixnum_val(argv[0]);
+
+    for (int i = 1; i < argc; i++) {
+        assert(type(argv[i]) == TYPE_INT, "expected TYPE_INT");
+        result /= fixnum_val(argv[i]);
+    }
+    return new_int(result);
+}
 
-    int initial_val = obj->int_val;
-    args = cdr(args);
+Object* _proc_equals(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    assert(type(argv[0]) == TYPE_INT, "expected TYPE_INT");
+    int initial_val = fixnum_val(argv[0]);
 
-    while (args != empty_list) {
-        obj = car(args);
-        assert(type(obj) == TYPE_INT, "expected TYPE_INT");
+    for (int i = 1; i < argc; i++) {
+        assert(type(argv[i]) == TYPE_INT, "expected TYPE_INT");
 
-        if (obj->int_val != initial_val)
+        if (fixnum_val(argv[i]) != initial_val)
             return false_obj;
-
-        args = cdr(args);
     }
     return true_obj;
 }
 
-Object* _proc_less_than(Object* args) {
-    Object* obj = car(args);
-    assert(type(obj) == TYPE_INT, "expected TYPE_INT");
-
-    int initial_val = obj->int_val;
-    args = cdr(args);
+Object* _proc_less_than(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    assert(type(argv[0]) == TYPE_INT, "expected TYPE_INT");
+    int initial_val = fixnum_val(argv[0]);
 
-    while (args != empty_list) {
-        obj = car(args);
-        assert(type(obj) == TYPE_INT, "expected TYPE_INT");
+    for (int i = 1; i < argc; i++) {
+        assert(type(argv[i]) == TYPE_INT, "expected TYPE_INT");
 
-        if (!(obj->int_val < initial_val))
+        if (!(fixnum_val(argv[i]) < initial_val))
             return false_obj;
-
-        args = cdr(args);
     }
     return true_obj;
 }
@@ -213,20 +1112,22 @@ Object* bool_object(bool expression) {
     return expression ? true_obj : false_obj;
 }
 
-Object* _proc_is_null(Object* args) {
-    return bool_object(car(args) == empty_list);
+Object* _proc_is_null(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    (void)argc;
+    return bool_object(argv[0] == empty_list);
 }
 
-Object* _proc_is_eq(Object* args) {
-    Object* a = car(args);
-    Object* b = cadr(args);
+Object* _proc_is_eq(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    (void)argc;
+    Object* a = argv[0];
+    Object* b = argv[1];
 
     if (type(a) != type(b))
         return false_obj;
 
     switch(type(a)) {
-        case TYPE_INT: 
-            return bool_object(a->bool_val == b->bool_val);
         case TYPE_STRING: 
             return bool_object(!strcmp(a->str_val, b->str_val));
         default: 
@@ -234,297 +1135,759 @@ Object* _proc_is_eq(Object* args) {
     }
 }
 
-Object* _proc_is_number(Object* args) {
-    return bool_object(type(car(args)) == TYPE_INT);
+Object* _proc_is_number(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    (void)argc;
+    return bool_object(type(argv[0]) == TYPE_INT);
 }
 
-Object* _proc_is_string(Object* args) {
-    return bool_object(type(car(args)) == TYPE_STRING);
+Object* _proc_is_string(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    (void)argc;
+    return bool_object(type(argv[0]) == TYPE_STRING);
 }
 
-Object* _proc_is_symbol(Object* args) {
-    return bool_object(type(car(args)) == TYPE_SYMBOL);
+Object* _proc_is_symbol(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    (void)argc;
+    return bool_object(type(argv[0]) == TYPE_SYMBOL);
 }
 
-Object* _proc_is_pair(Object* args) {
-    return bool_object(type(car(args)) == TYPE_PAIR);
+Object* _proc_is_pair(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    (void)argc;
+    return bool_object(type(argv[0]) == TYPE_PAIR);
 }
 
-Object* _proc_list(Object* args) {
-    if (args == empty_list)
-        return empty_list;
-
-    return cons(car(args), _proc_list(cdr(args)));
+Object* _proc_list(Interp* interp, int argc, Object** argv) {
+    // argv is rooted by the caller, and cons protects what it is given
+    Object* list = empty_list;
+    GC_PROTECT(list);
+    for (int i = argc - 1; i >= 0; i--)
+        list = cons(interp, argv[i], list);
+    GC_UNPROTECT(1);
+    return list;
 }
 
-Object* _proc_car(Object* args) {
-    return car(car(args));
+Object* _proc_car(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    (void)argc;
+    return car(argv[0]);
 }
 
-Object* _proc_cdr(Object* args) {
-    return cdr(car(args));
+Object* _proc_cdr(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    (void)argc;
+    return cdr(argv[0]);
 }
 
-Object* _proc_cons(Object* args) {
-    return cons(car(args), cadr(args));
+Object* _proc_cons(Interp* interp, int argc, Object** argv) {
+    (void)argc;
+    return cons(interp, argv[0], argv[1]);
 }
 
-Object* _proc_set_car(Object* args) {
-    Object* pair = car(args);
-    pair->car = cadr(args);
-    return ok_symbol;
+Object* _proc_set_car(Interp* interp, int argc, Object** argv) {
+    (void)argc;
+    assert(type(argv[0]) == TYPE_PAIR, "proc set-car! expected pair");
+    argv[0]->car = argv[1];
+    return interp->ok_symbol;
 }
 
-Object* _proc_set_cdr(Object* args) {
-    Object* pair = car(args);
-    pair->cdr = cadr(args);
-    return ok_symbol;
+Object* _proc_set_cdr(Interp* interp, int argc, Object** argv) {
+    (void)argc;
+    assert(type(argv[0]) == TYPE_PAIR, "proc set-cdr! expected pair");
+    argv[0]->cdr = argv[1];
+    return interp->ok_symbol;
 }
 
-Object* _proc_load(Object* args) {
-    assert(type(car(args)) == TYPE_STRING, "proc load expected string");
-    char* filename = car(args)->str_val;
+Object* _proc_load(Interp* interp, int argc, Object** argv) {
+    (void)argc;
+    assert(type(argv[0]) == TYPE_STRING, "proc load expected string");
+    load_file(interp, argv[0]->str_val);
+    return interp->ok_symbol;
+}
 
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "could not open file: %s\n", filename);
-        exit(1);
-    }
+Object* _proc_heap_report(Interp* interp, int argc, Object** argv) {
+    (void)argc;
+    (void)argv;
+    heap_report(interp, interp->out);
+    return interp->ok_symbol;
+}
 
-    LexState ls = {};
-    ls.stream = file;
-    eval_all(&ls, false);
-    fclose(file);
+Object* stats_entry(Interp* interp, Object* list, char* name, size_t value) {
+    GC_PROTECT(list);
+    Object* entry = cons(interp, new_symbol(interp, name),
+                         new_int(value > INT_MAX ? INT_MAX : value));
+    list = cons(interp, entry, list);
+    GC_UNPROTECT(1);
+    return list;
+}
 
-    return ok_symbol;
+Object* reverse_list(Object* list) {
+    Object* result = empty_list;
+    while (list != empty_list) {
+        Object* next = cdr(list);
+        list->cdr = result;
+        result = list;
+        list = next;
+    }
+    return result;
 }
 
-Object* _proc_error(Object* args) {
-    while (args != empty_list) {
-        print_object(car(args));
-        printf(" ");
-        args = cdr(args);
+// returns the runtime counters as an association list, with a by-type
+// entry holding (type objects bytes) for each type allocated so far
+Object* _proc_runtime_stats(Interp* interp, int argc, Object** argv) {
+    Heap* heap = interp->heap;
+    RuntimeStats* counters = &interp->counters;
+    (void)argc;
+    (void)argv;
+    size_t total = 0;
+    size_t total_bytes = 0;
+    Object* by_type = empty_list;
+    GC_PROTECT(by_type);
+    for (int t = TYPE_FREE - 1; t >= 0; t--) {
+        total += counters->allocations[t];
+        total_bytes += counters->allocated_bytes[t];
+        if (counters->allocations[t] == 0)
+            continue;
+        char label[32];
+        type_label(t, label, sizeof(label));
+        Object* bytes = cons(interp, new_int(counters->allocated_bytes[t] > INT_MAX ? INT_MAX
+                                     : counters->allocated_bytes[t]), empty_list);
+        Object* entry = cons(interp, new_int(counters->allocations[t] > INT_MAX ? INT_MAX
+                                     : counters->allocations[t]), bytes);
+        GC_PROTECT(entry);
+        Object* name = new_symbol(interp, label);
+        entry = cons(interp, name, entry);
+        by_type = cons(interp, entry, by_type);
+        GC_UNPROTECT(1);
     }
-    printf("\n");
-    exit(1);
+    by_type = cons(interp, new_symbol(interp, "by-type"), by_type);
+
+    Object* list = empty_list;
+    GC_PROTECT(list);
+    list = stats_entry(interp, list, "allocated-objects", total);
+    list = stats_entry(interp, list, "allocated-bytes", total_bytes);
+    list = stats_entry(interp, list, "frames", counters->allocations[TYPE_FRAME]);
+    list = stats_entry(interp, list, "argument-lists", counters->argument_lists);
+    list = stats_entry(interp, list, "evals", counters->evals);
+    list = stats_entry(interp, list, "calls", counters->calls);
+    list = stats_entry(interp, list, "primitive-calls", counters->primitive_calls);
+    list = stats_entry(interp, list, "native-compiles", counters->native_compiles);
+    list = stats_entry(interp, list, "deopts", counters->deopts);
+    list = stats_entry(interp, list, "max-depth", counters->max_depth);
+    list = stats_entry(interp, list, "collections", heap->collections);
+    list = stats_entry(interp, list, "live-bytes", heap->bytes_live);
+    list = stats_entry(interp, list, "max-live-bytes", heap->max_live_bytes);
+    list = stats_entry(interp, list, "reserved-bytes", heap->bytes_reserved);
+    list = stats_entry(interp, list, "chunks", heap->num_chunks);
+    list = cons(interp, by_type, list);
+    list = reverse_list(list);
+    GC_UNPROTECT(2);
+    return list;
 }
 
-/* Environment */
+Object* _proc_future(Interp* interp, int argc, Object** argv) {
+    (void)argc;
+    assert(type(argv[0]) == TYPE_PROCEDURE || type(argv[0]) == TYPE_PRIMITIVE,
+           "proc future expected procedure");
+    return spawn_future(interp, argv[0]);
+}
 
-Object* extend_environment(Object* vars, Object* vals, Object* env) {
-    return cons(cons(vars, vals), env);
+Object* _proc_touch(Interp* interp, int argc, Object** argv) {
+    (void)argc;
+    assert(type(argv[0]) == TYPE_FUTURE, "proc touch expected future");
+    return touch_future(interp, argv[0]);
 }
 
-void add_binding(Object* var, Object* val, Object* frame) {
-    frame->car = cons(var, car(frame));
-    frame->cdr = cons(val, cdr(frame));
+Object* _proc_pmap(Interp* interp, int argc, Object** argv) {
+    (void)argc;
+    return parallel_map(interp, argv[0], argv[1], TASK_MAP);
 }
 
-void define_variable(Object* var, Object* val, Object* env) {
-    Object* frame = car(env);
-    Object* vars = car(frame);
-    Object* vals = cdr(frame);
+Object* _proc_parallel_for_each(Interp* interp, int argc, Object** argv) {
+    (void)argc;
+    return parallel_map(interp, argv[0], argv[1], TASK_FOR_EACH);
+}
 
-    while (vars != empty_list) {
-        if (car(vars) == var) {
-            vals->car = val;
-            return;
-        }
-        vars = cdr(vars);
-        vals = cdr(vals);
+Object* _proc_error(Interp* interp, int argc, Object** argv) {
+    (void)interp;
+    char message[ERROR_MESSAGE_MAX] = {0};
+    FILE* stream = fmemopen(message, sizeof(message) - 1, "w");
+    assert(stream != NULL, "out of memory");
+    for (int i = 0; i < argc; i++) {
+        if (i > 0)
+            fputc(' ', stream);
+        write_object(stream, argv[i]);
     }
-    add_binding(var, val, frame);
+    fclose(stream);
+    raise_error("%s", message);
 }
 
-void set_variable_value(Object* var, Object* val, Object* env) {
-    Object* frame;
-    Object* vars;
-    Object* vals;
+bool primitive_accepts(Object* proc, int argc) {
+    return argc >= proc->min_args && (proc->max_args == VARIADIC || argc <= proc->max_args);
+}
 
-    while (env != empty_list) {
-        frame = car(env);
-        vars = car(frame);
-        vals = cdr(frame);
+void wrong_primitive_arguments(int argc) {
+    raise_error("wrong number of arguments to primitive: %d", argc);
+}
 
-        while (vars != empty_list) {
-            if (car(vars) == var) {
-                vals->car = val;
-                return;
-            }
-            vars = cdr(vars);
-            vals = cdr(vals);
-        }
-        env = cdr(env);
+// calls a primitive with argc values at argv, which the caller keeps rooted
+// and has checked against the primitive's arity
+Object* invoke_primitive(Interp* interp, Object* proc, int argc, Object** argv) {
+    interp->counters.primitive_calls++;
+    if (interp->profiler.enabled) {
+        profile_enter(interp, proc);
+        Object* result = proc->func(interp, argc, argv);
+        profile_exit(interp);
+        return result;
     }
+    return proc->func(interp, argc, argv);
+}
 
-    fprintf(stderr, "unbound variable: %s\n", var->str_val);
-    exit(1);
+Object* call_primitive(Interp* interp, Object* proc, int argc, Object** argv) {
+    if (!primitive_accepts(proc, argc))
+        wrong_primitive_arguments(argc);
+    return invoke_primitive(interp, proc, argc, argv);
 }
 
-Object* lookup_variable(Object* var, Object* env) {
-    Object* frame;
-    Object* vars;
-    Object* vals;
+/* Environment */
 
-    while (env != empty_list) {
-        frame = car(env);
-        vars = car(frame);
-        vals = cdr(frame);
+Object* new_frame(Interp* interp, Object* vars, int num_slots, Object* parent) {
+    GC_PROTECT(vars);
+    GC_PROTECT(parent);
+    Object* frame = allocate(interp, TYPE_FRAME,
+                             offsetof(Object, slots) + num_slots * sizeof(Object*));
+    GC_UNPROTECT(2);
+
+    frame->parent = parent;
+    frame->vars = vars;
+    frame->overflow = empty_list;
+    frame->num_slots = num_slots;
+    for (int i = 0; i < num_slots; i++)
+        frame->slots[i] = unbound_obj;
+    return frame;
+}
 
-        while (vars != empty_list) {
-            Object* sym = car(vars);
-            if (sym == var) {
-                return car(vals);
-            }
-            vars = cdr(vars);
-            vals = cdr(vals);
-        }
-        env = cdr(env);
-    }
+// slots past the supplied values belong to the procedure's internal
+// definitions and start out unbound
+Object* extend_environment(Interp* interp, Object* vars, int num_slots, Object* vals, Object* env) {
+    interp->counters.argument_lists++;
+    GC_PROTECT(vals);
+    Object* frame = new_frame(interp, vars, num_slots, env);
+    GC_UNPROTECT(1);
 
-    fprintf(stderr, "unbound variable: %s\n", var->str_val);
-    exit(1);
+    for (int i = 0; i < num_slots && vals != empty_list; i++) {
+        frame->slots[i] = car(vals);
+        vals = cdr(vals);
+    }
+    return frame;
 }
 
-void add_procedure(char* name, Object *proc(Object *args)) {
-    define_variable(new_symbol(name),
-                    new_primitive(proc),
-                    global_env);
-}
-
-void init() {
-    empty_list = new_object(TYPE_EMPTYLIST);
-
-    true_obj = new_object(TYPE_BOOL);
-    true_obj->bool_val = true;
-    false_obj = new_object(TYPE_BOOL);
-    false_obj->bool_val = false;
-
-    global_env = extend_environment(empty_list, empty_list, empty_list);
-
-    symbols_head  = empty_list;
-    quote_symbol  = new_symbol("quote");
-    define_symbol = new_symbol("define");
-    set_symbol    = new_symbol("set!");
-    ok_symbol     = new_symbol("ok");
-    if_symbol     = new_symbol("if");
-    lambda_symbol = new_symbol("lambda");
-    cond_symbol   = new_symbol("cond");
-    else_symbol   = new_symbol("else");
-    apply_symbol  = new_symbol("apply");
-    let_symbol    = new_symbol("let");
-
-    add_procedure("+",        _proc_add);
-    add_procedure("-",        _proc_sub);
-    add_procedure("*",        _proc_mul);
-    add_procedure("/",        _proc_div);
-    add_procedure("=",        _proc_equals);
-    add_procedure("<",        _proc_less_than);
-
-    add_procedure("null?",    _proc_is_null);
-    add_procedure("eq?",      _proc_is_eq);
-    add_procedure("number?",  _proc_is_number);
-    add_procedure("string?",  _proc_is_string);
-    add_procedure("symbol?",  _proc_is_symbol);
-    add_procedure("pair?",    _proc_is_pair);
-    
-    add_procedure("list",     _proc_list);
-    add_procedure("car",      _proc_car);
-    add_procedure("cdr",      _proc_cdr);
-    add_procedure("cons",     _proc_cons);
-    add_procedure("set-car!", _proc_set_car);
-    add_procedure("set-cdr!", _proc_set_cdr);
-
-    add_procedure("load",     _proc_load);
-    add_procedure("error",    _proc_error);
+void add_binding(Interp* interp, Object* var, Object* val, Object* frame) {
+    GC_PROTECT(val);
+    GC_PROTECT(frame);
+    Object* vars = cons(interp, var, car(frame));
+    frame->car = vars;
+    Object* vals = cons(interp, val, cdr(frame));
+    frame->cdr = vals;
+    GC_UNPROTECT(2);
 }
 
-/* Lex */
+Object** frame_slot(Object* frame, Object* var) {
+    Object* vars = frame->vars;
+    for (int i = 0; i < frame->num_slots; i++) {
+        if (car(vars) == var)
+            return &frame->slots[i];
+        vars = cdr(vars);
+    }
 
-int peek(FILE* stream) {
-    int c = getc(stream);
-    ungetc(c, stream);
-    return c;
-}
+    if (frame->overflow == empty_list)
+        return NULL;
 
-void skip_whitespace(FILE* stream) {
-    int c = getc(stream);
-    while (c != EOF) {
-        if (isspace(c)) {
-            c = getc(stream);
-            continue;
-        }
+    vars = car(frame->overflow);
+    Object* vals = cdr(frame->overflow);
+    while (vars != empty_list) {
+        if (car(vars) == var)
+            return &vals->car;
+        vars = cdr(vars);
+        vals = cdr(vals);
+    }
+    return NULL;
+}
 
-        if (c == ';') {
-            while (c != EOF && c != '\n') {
-                c = getc(stream);
+// stores the global value of a symbol; only call site caches of a
+// procedure that was there can be affected. The epoch moves after the
+// store, so a thread that sees the new epoch sees the new value, and one
+// that reads the new value sees the object it was made as.
+void set_global(Interp* interp, Object* symbol, Object* value) {
+    Object* old = symbol->value;
+    __atomic_store_n(&symbol->value, value, __ATOMIC_RELEASE);
+    if (!is_immediate(old) && (old->type == TYPE_PROCEDURE || old->type == TYPE_PRIMITIVE))
+        __atomic_add_fetch(&interp->heap->global_epoch, 1, __ATOMIC_RELEASE);
+}
+
+void define_variable(Interp* interp, Object* var, Object* val, Object* env) {
+    if (env == interp->global_env) {
+        set_global(interp, var, val);
+        return;
+    }
+
+    Object** slot = frame_slot(env, var);
+    if (slot != NULL) {
+        *slot = val;
+        return;
+    }
+
+    GC_PROTECT(var);
+    GC_PROTECT(val);
+    GC_PROTECT(env);
+    if (env->overflow == empty_list) {
+        Object* overflow = cons(interp, empty_list, empty_list);
+        env->overflow = overflow;
+    }
+    add_binding(interp, var, val, env->overflow);
+    GC_UNPROTECT(3);
+}
+
+void set_variable_value(Interp* interp, Object* var, Object* val, Object* env) {
+    while (env != interp->global_env) {
+        Object** slot = frame_slot(env, var);
+        if (slot != NULL && *slot != unbound_obj) {
+            *slot = val;
+            return;
+        }
+        env = env->parent;
+    }
+
+    if (var->value != unbound_obj) {
+        set_global(interp, var, val);
+        return;
+    }
+
+    raise_error("unbound variable: %s", var->str_val);
+}
+
+Object* lookup_variable(Interp* interp, Object* var, Object* env) {
+    while (env != interp->global_env) {
+        Object** slot = frame_slot(env, var);
+        if (slot != NULL && *slot != unbound_obj)
+            return *slot;
+        env = env->parent;
+    }
+
+    if (var->value != unbound_obj)
+        return var->value;
+
+    raise_error("unbound variable: %s", var->str_val);
+}
+
+Object** variable_slot(Object* ref, Object* env) {
+    if (type(ref) == TYPE_GLOBALREF)
+        return &ref->name->value;
+
+    for (int depth = ref->depth; depth > 0; depth--)
+        env = env->parent;
+    return &env->slots[ref->index];
+}
+
+Object** local_slot(Object* env, int depth, int index) {
+    while (depth-- > 0)
+        env = env->parent;
+    return &env->slots[index];
+}
+
+// the variable a local slot belongs to
+Object* slot_name(Object* env, int depth, int index) {
+    while (depth-- > 0)
+        env = env->parent;
+
+    Object* vars = env->vars;
+    while (index-- > 0)
+        vars = cdr(vars);
+    return car(vars);
+}
+
+void unbound_local(Object* env, int depth, int index) {
+    raise_error("unbound variable: %s", slot_name(env, depth, index)->str_val);
+}
+
+void unbound_global(Object* symbol) {
+    raise_error("unbound variable: %s", symbol->str_val);
+}
+
+Object* lookup_ref(Object* ref, Object* env) {
+    Object* val = *variable_slot(ref, env);
+    if (val == unbound_obj)
+        raise_error("unbound variable: %s", ref->name->str_val);
+    return val;
+}
+
+const PrimitiveDef primitives[] = {
+    {"+",        _proc_add,       0, VARIADIC},
+    {"-",        _proc_sub,       1, VARIADIC},
+    {"*",        _proc_mul,       0, VARIADIC},
+    {"/",        _proc_div,       1, VARIADIC},
+    {"=",        _proc_equals,    1, VARIADIC},
+    {"<",        _proc_less_than, 1, VARIADIC},
+
+    {"null?",    _proc_is_null,   1, 1},
+    {"eq?",      _proc_is_eq,     2, 2},
+    {"number?",  _proc_is_number, 1, 1},
+    {"string?",  _proc_is_string, 1, 1},
+    {"symbol?",  _proc_is_symbol, 1, 1},
+    {"pair?",    _proc_is_pair,   1, 1},
+
+    {"list",     _proc_list,      0, VARIADIC},
+    {"car",      _proc_car,       1, 1},
+    {"cdr",      _proc_cdr,       1, 1},
+    {"cons",     _proc_cons,      2, 2},
+    {"set-car!", _proc_set_car,   2, 2},
+    {"set-cdr!", _proc_set_cdr,   2, 2},
+
+    {"load",     _proc_load,      1, 1},
+    {"error",    _proc_error,     0, VARIADIC},
+    {"heap-report", _proc_heap_report, 0, 0},
+    {"runtime-stats", _proc_runtime_stats, 0, 0},
+
+    {"future",   _proc_future,    1, 1},
+    {"touch",    _proc_touch,     1, 1},
+    {"pmap",     _proc_pmap,      2, 2},
+    {"parallel-for-each", _proc_parallel_for_each, 2, 2},
+};
+
+#define NUM_PRIMITIVES (sizeof(primitives) / sizeof(primitives[0]))
+
+const InlineDef inline_ops[] = {
+    [INLINE_ADD]       = {_proc_add,       2},
+    [INLINE_SUB]       = {_proc_sub,       2},
+    [INLINE_MUL]       = {_proc_mul,       2},
+    [INLINE_EQUALS]    = {_proc_equals,    2},
+    [INLINE_LESS_THAN] = {_proc_less_than, 2},
+    [INLINE_IS_NULL]   = {_proc_is_null,   1},
+    [INLINE_IS_EQ]     = {_proc_is_eq,     2},
+    [INLINE_IS_PAIR]   = {_proc_is_pair,   1},
+    [INLINE_CAR]       = {_proc_car,       1},
+    [INLINE_CDR]       = {_proc_cdr,       1},
+    [INLINE_CONS]      = {_proc_cons,      2},
+};
+
+#define NUM_INLINE_OPS (sizeof(inline_ops) / sizeof(inline_ops[0]))
+
+// runs an inline operation on its arguments: fixnums and pairs are handled
+// here, anything else goes to the primitive so errors are reported the same
+Object* run_inline(Interp* interp, InlineOp op, Object** args) {
+    Object* a = args[0];
+    switch (op) {
+        case INLINE_ADD:
+            if (is_fixnum(a) && is_fixnum(args[1]))
+                return make_fixnum(fixnum_val(a) + fixnum_val(args[1]));
+            break;
+        case INLINE_SUB:
+            if (is_fixnum(a) && is_fixnum(args[1]))
+                return make_fixnum(fixnum_val(a) - fixnum_val(args[1]));
+            break;
+        case INLINE_MUL:
+            if (is_fixnum(a) && is_fixnum(args[1]))
+                return make_fixnum(fixnum_val(a) * fixnum_val(args[1]));
+            break;
+        case INLINE_EQUALS:
+            if (is_fixnum(a) && is_fixnum(args[1]))
+                return bool_object(a == args[1]);
+            break;
+        case INLINE_LESS_THAN:
+            if (is_fixnum(a) && is_fixnum(args[1]))
+                return bool_object(fixnum_val(args[1]) < fixnum_val(a));
+            break;
+        case INLINE_IS_NULL:
+            return bool_object(a == empty_list);
+        case INLINE_IS_EQ:
+            if (is_immediate(a) || a->type != TYPE_STRING)
+                return bool_object(a == args[1]);
+            break;
+        case INLINE_IS_PAIR:
+            return bool_object(!is_immediate(a) && a->type == TYPE_PAIR);
+        case INLINE_CAR:
+            if (!is_immediate(a) && a->type == TYPE_PAIR)
+                return a->car;
+            break;
+        case INLINE_CDR:
+            if (!is_immediate(a) && a->type == TYPE_PAIR)
+                return a->cdr;
+            break;
+        case INLINE_CONS:
+            return cons(interp, a, args[1]);
+    }
+    return inline_ops[op].func(interp, inline_ops[op].argc, args);
+}
+
+Object* add_procedure(Interp* interp, const PrimitiveDef* def) {
+    Object* symbol = new_symbol(interp, def->name);
+    Object* primitive = new_primitive(interp, def);
+    define_variable(interp, symbol, primitive, interp->global_env);
+    return primitive;
+}
+
+void vm_init(Interp* interp);
+
+// an interpreter with the default settings, which can be changed until init
+// sets up its global environment; its thread is the first in a new heap
+Interp* new_interp() {
+    Interp* interp = calloc(1, sizeof(Interp));
+    Heap* heap = calloc(1, sizeof(Heap));
+    assert(interp != NULL && heap != NULL, "out of memory");
+    interp->out = stdout;
+    pthread_mutex_init(&heap->lock, NULL);
+    pthread_cond_init(&heap->stopped, NULL);
+    pthread_cond_init(&heap->resumed, NULL);
+    pthread_mutex_init(&heap->symbols_lock, NULL);
+    pthread_mutex_init(&heap->code_lock, NULL);
+    pthread_mutex_init(&heap->pool.lock, NULL);
+    pthread_cond_init(&heap->pool.work, NULL);
+    pthread_cond_init(&heap->pool.done, NULL);
+    heap->global_epoch = 1;
+    heap->trigger = GC_DEFAULT_TRIGGER;
+    heap->heap_max = GC_DEFAULT_HEAP_MAX;
+    heap->next_collection = GC_DEFAULT_TRIGGER;
+    heap->threads = interp;
+    heap->num_threads = 1;
+    heap->running = 1;
+
+    interp->heap = heap;
+    interp->worker = -1;
+    interp->engine = ENGINE_VM;
+    interp->optimize = true;
+    interp->jit = true;
+    return interp;
+}
+
+// a context on interp's heap for another thread, with interp's globals and
+// settings; the thread calls gc_enter before it allocates
+Interp* new_thread_interp(Interp* interp) {
+    Interp* thread = malloc(sizeof(Interp));
+    assert(thread != NULL, "out of memory");
+    *thread = *interp;
+    memset(&thread->gc, 0, sizeof(GCState));
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+        thread->gc.swept[i] = true;
+    memset(&thread->profiler, 0, sizeof(Profiler));
+    memset(&thread->counters, 0, sizeof(RuntimeStats));
+    thread->compilers = NULL;
+    thread->worker = -1;
+    thread->out = stdout;
+    vm_init(thread);
+
+    Heap* heap = interp->heap;
+    pthread_mutex_lock(&heap->lock);
+    thread->next_thread = heap->threads;
+    heap->threads = thread;
+    heap->num_threads++;
+    pthread_mutex_unlock(&heap->lock);
+    return thread;
+}
+
+void free_thread_interp(Interp* thread) {
+    free(thread->gc.roots);
+    free(thread->vm.stack);
+    free(thread->vm.frames);
+    profile_free(&thread->profiler.root);
+    free(thread->profiler.stack);
+    free(thread);
+}
+
+void init(Interp* interp) {
+    vm_init(interp);
+    interp->global_env = new_frame(interp, empty_list, 0, empty_list);
+
+    interp->quote_symbol  = new_special_form(interp, "quote",  FORM_QUOTE);
+    interp->define_symbol = new_special_form(interp, "define", FORM_DEFINE);
+    interp->set_symbol    = new_special_form(interp, "set!",   FORM_SET);
+    interp->if_symbol     = new_special_form(interp, "if",     FORM_IF);
+    interp->lambda_symbol = new_special_form(interp, "lambda", FORM_LAMBDA);
+    interp->cond_symbol   = new_special_form(interp, "cond",   FORM_COND);
+    interp->apply_symbol  = new_special_form(interp, "apply",  FORM_APPLY);
+    interp->let_symbol    = new_special_form(interp, "let",    FORM_LET);
+    interp->begin_symbol  = new_special_form(interp, "begin",  FORM_BEGIN);
+    interp->let_star_symbol = new_special_form(interp, "let*", FORM_LET_STAR);
+    interp->letrec_symbol = new_special_form(interp, "letrec", FORM_LETREC);
+    interp->and_symbol    = new_special_form(interp, "and",    FORM_AND);
+    interp->or_symbol     = new_special_form(interp, "or",     FORM_OR);
+    interp->ok_symbol     = new_symbol(interp, "ok");
+    interp->else_symbol   = new_symbol(interp, "else");
+
+    // the temporary that or binds and the keyword of the optimizer's inline
+    // form can't be written in a program
+    interp->or_temp_symbol = new_hidden_symbol(interp, "or-value", FORM_NONE);
+    interp->inline_symbol = new_hidden_symbol(interp, "inline", FORM_INLINE);
+
+    interp->primitive_objects = calloc(NUM_PRIMITIVES + 1, sizeof(Object*));
+    assert(interp->primitive_objects != NULL, "out of memory");
+    for (size_t i = 0; i < NUM_PRIMITIVES; i++)
+        interp->primitive_objects[i] = add_procedure(interp, &primitives[i]);
+}
+
+// releases the interpreter, its workers and everything they allocated
+void free_interp(Interp* interp) {
+    Heap* heap = interp->heap;
+    pool_stop(interp);
+    while (heap->chunks != NULL) {
+        Chunk* chunk = heap->chunks;
+        for (char* cell = chunk->cells; cell < chunk->bump; cell += chunk->cell_size) {
+            Object* object = (Object*)cell;
+            if (object->type == TYPE_STRING ||
+                (object->type == TYPE_SYMBOL && object != interp->or_temp_symbol &&
+                 object != interp->inline_symbol)) {
+                free(object->str_val);
+            } else if (object->type == TYPE_CODE) {
+                free(object->instrs);
+                free(object->consts);
+                free(object->caches);
+                if (object->native != NULL)
+                    free_native(object->native);
+            } else if (object->type == TYPE_FUTURE) {
+                free(object->error);
             }
-            continue;
         }
-        ungetc(c, stream);
-        break;
+        heap->chunks = chunk->next;
+        free(chunk);
+    }
+    free(heap->mark_stack);
+    free(heap->symbols.entries);
+    free_discarded(heap);
+    pthread_mutex_destroy(&heap->lock);
+    pthread_cond_destroy(&heap->stopped);
+    pthread_cond_destroy(&heap->resumed);
+    pthread_mutex_destroy(&heap->symbols_lock);
+    pthread_mutex_destroy(&heap->code_lock);
+    pthread_mutex_destroy(&heap->pool.lock);
+    pthread_cond_destroy(&heap->pool.work);
+    pthread_cond_destroy(&heap->pool.done);
+    free(heap);
+    free(interp->primitive_objects);
+    free_thread_interp(interp);
+}
+
+/* Lex */
+
+void lex_open_buffer(LexState* ls, const char* buf, size_t len) {
+    ls->cur = buf;
+    ls->end = buf + len;
+    ls->data = NULL;
+    ls->size = 0;
+    ls->mapped = false;
+}
+
+// maps a regular file; anything else (a pipe, a terminal) is read in blocks
+void lex_open_file(LexState* ls, FILE* file) {
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            lex_open_buffer(ls, data, st.st_size);
+            ls->data = data;
+            ls->size = st.st_size;
+            ls->mapped = true;
+            return;
+        }
     }
+
+    size_t capacity = LEX_BLOCK_SIZE;
+    size_t len = 0;
+    char* buf = malloc(capacity);
+    assert(buf != NULL, "out of memory");
+    size_t n;
+    while ((n = fread(buf + len, 1, capacity - len, file)) > 0) {
+        len += n;
+        if (len == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+            assert(buf != NULL, "out of memory");
+        }
+    }
+    lex_open_buffer(ls, buf, len);
+    ls->data = buf;
+    ls->size = len;
+}
+
+void lex_close(LexState* ls) {
+    if (ls->mapped)
+        munmap(ls->data, ls->size);
+    else
+        free(ls->data);
+    ls->data = NULL;
+}
+
+bool is_symbol_char(unsigned char c) {
+    return isalnum(c) || (c < sizeof(valid_chars) && valid_chars[c]);
 }
 
-int read_int(FILE* stream) {
-    int c = getc(stream);
-    int value = c - '0';
+void skip_whitespace(LexState* ls) {
+    const char* p = ls->cur;
+    while (p < ls->end) {
+        if (isspace((unsigned char)*p)) {
+            p++;
+        } else if (*p == ';') {
+            const char* newline = memchr(p, '\n', ls->end - p);
+            p = newline ? newline + 1 : ls->end;
+        } else {
+            break;
+        }
+    }
+    ls->cur = p;
+}
 
-    c = getc(stream);
-    while (isdigit(c)) {
+int read_int(LexState* ls) {
+    const char* p = ls->cur;
+    int value = 0;
+    while (p < ls->end && isdigit((unsigned char)*p)) {
         value *= 10;
-        value += c - '0';
-        c = getc(stream);
+        value += *p - '0';
+        p++;
     }
-    ungetc(c, stream);
+    ls->cur = p;
     return value;
 }
 
-void next_token(LexState* ls) {
-    skip_whitespace(ls->stream);
-    char buf[BUF_MAX];
-    int value;
-    int sign = 1;
-    int c = getc(ls->stream);
+void next_token(Interp* interp, LexState* ls) {
+    skip_whitespace(ls);
+    if (ls->cur == ls->end) {
+        ls->token.kind = TK_EOF;
+        return;
+    }
+
+    const char* start = ls->cur;
+    unsigned char c = *ls->cur++;
 
     switch (c) {
-        case EOF: 
-            ls->token.kind = TK_EOF;
-            break;
-
         case '#':
-            c = getc(ls->stream);
-            assert(c == 't' || c == 'f', "bool must be #t or #f");
+            assert(ls->cur < ls->end && (*ls->cur == 't' || *ls->cur == 'f'),
+                   "bool must be #t or #f");
             ls->token.kind = TK_BOOL;
-            ls->token.bool_val = c == 't' ? true : false;
+            ls->token.bool_val = *ls->cur++ == 't';
             break;
 
         case '0'...'9':
-            ungetc(c, ls->stream);
-            value = read_int(ls->stream);
+            ls->cur = start;
             ls->token.kind = TK_INT;
-            ls->token.int_val = sign * value;
+            ls->token.int_val = read_int(ls);
             break;
 
-        case '\"':
-            c = getc(ls->stream);
-            int len = 0;
-            while (c != EOF && c != '\"') {
-                if (len == BUF_MAX - 1) {
-                    fprintf(stderr, "exceeded max buffer length\n");
-                    exit(1);
-                }
-
-                buf[len++] = c;
-                c = getc(ls->stream);
-            }
+        case '\"': {
+            // an unterminated string runs to the end of the input
+            const char* quote = memchr(ls->cur, '\"', ls->end - ls->cur);
+            const char* last = quote ? quote : ls->end;
+            size_t len = last - ls->cur;
             char* str = malloc(len + 1);
-            memcpy(str, buf, len);
+            assert(str != NULL, "out of memory");
+            memcpy(str, ls->cur, len);
             str[len] = '\0';
+            ls->cur = quote ? quote + 1 : ls->end;
 
             ls->token.kind = TK_STRING;
             ls->token.str_val = str;
             break;
+        }
 
         case '_':
         case '+': case '-': case '*': case '/':
@@ -532,38 +1895,17 @@ void next_token(LexState* ls) {
         case 'A'...'Z':
         case 'a'...'z': {
             // parse as number if digits follow minus sign
-            if (c == '-' && isdigit(peek(ls->stream))) {
-                sign = -1;
-                value = read_int(ls->stream);
+            if (c == '-' && ls->cur < ls->end && isdigit((unsigned char)*ls->cur)) {
                 ls->token.kind = TK_INT;
-                ls->token.int_val = sign * value;
+                ls->token.int_val = -read_int(ls);
                 break;
             }
 
-            // otherwise, parse as symbol
-            int len = 0;
-            while (isalnum(c) || valid_chars[c]) {
-                if (len == BUF_MAX - 1) {
-                    fprintf(stderr, "exceeded max buffer length\n");
-                    exit(1);
-                }
-
-                buf[len++] = c;
-                c = getc(ls->stream);
-            }
-            ungetc(c, ls->stream);
-            buf[len] = '\0';
-
-            Object* symbol = get_symbol(buf);
-            if (symbol == NULL) {
-                // allocate memory for the string
-                char* str = malloc(len + 1);
-                memcpy(str, buf, len);
-                str[len] = '\0';
-                symbol = new_symbol(str);
-            }
+            // otherwise, parse as symbol, interned straight from the buffer
+            while (ls->cur < ls->end && is_symbol_char(*ls->cur))
+                ls->cur++;
 
-            ls->token.sym_val = symbol;
+            ls->token.sym_val = intern_symbol(interp, start, ls->cur - start);
             ls->token.kind = TK_SYMBOL;
         } break;
 
@@ -575,298 +1917,3867 @@ void next_token(LexState* ls) {
             break;
 
         default:
-            fprintf(stderr, "unexpected character: %c\n", c);
-            exit(1);
+            raise_error("unexpected character: %c", c);
+    }
+}
+
+// whether buf holds whole forms: every list closed, every string ended and
+// no quote waiting for its datum, so the REPL knows to read another line
+bool input_complete(const char* buf, size_t len) {
+    const char* p = buf;
+    const char* end = buf + len;
+    int depth = 0;
+    bool quoted = false;
+    while (p < end) {
+        unsigned char c = *p++;
+        if (isspace(c))
+            continue;
+        if (c == ';') {
+            const char* newline = memchr(p, '\n', end - p);
+            if (newline == NULL)
+                break;
+            p = newline + 1;
+            continue;
+        }
+        quoted = c == '\'';
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        } else if (c == '\"') {
+            const char* quote = memchr(p, '\"', end - p);
+            if (quote == NULL)
+                return false;
+            p = quote + 1;
+        }
     }
+    return depth <= 0 && !quoted;
 }
 
 /* Parse */
 
-Object* parse_pair(LexState* ls) {
+
+Object* parse_pair(Interp* interp, LexState* ls) {
     if (ls->token.kind == TK_RPAREN) {
-        next_token(ls);
+        next_token(interp, ls);
         return empty_list;
     }
 
-    Object* car_obj = parse_exp(ls);
+    Object* car_obj = parse_exp(interp, ls);
+    GC_PROTECT(car_obj);
 
     if (ls->token.kind == TK_DOT) {
         // parse as a pair
-        next_token(ls);
-        Object* cdr_obj = parse_exp(ls);
+        next_token(interp, ls);
+        Object* cdr_obj = parse_exp(interp, ls);
+        GC_PROTECT(cdr_obj);
 
+        // reading the token after ) can intern a symbol and collect
         assert(ls->token.kind == TK_RPAREN, "expected )");
-        next_token(ls);
+        next_token(interp, ls);
 
-        return cons(car_obj, cdr_obj);
+        Object* result = cons(interp, car_obj, cdr_obj);
+        GC_UNPROTECT(2);
+        return result;
     } else {
         // parse as a list
-        Object* head = cons(car_obj, empty_list);
+        Object* head = cons(interp, car_obj, empty_list);
         Object* result = head;
+        GC_PROTECT(result);
         while (ls->token.kind != TK_RPAREN) {
-            Object* tail = cons(parse_exp(ls), empty_list);
+            if (ls->token.kind == TK_EOF)
+                raise_error("unexpected end of input");
+            Object* tail = cons(interp, parse_exp(interp, ls), empty_list);
             head->cdr = tail;
             head = tail;
         }
 
-        next_token(ls);
+        next_token(interp, ls);
+        GC_UNPROTECT(2);
         return result;
     }
 }
 
-Object* parse_exp(LexState* ls) {
+Object* parse_exp(Interp* interp, LexState* ls) {
     Token token = ls->token;
-    next_token(ls);
+    next_token(interp, ls);
 
     switch (token.kind) {
-        case TK_EOF: return NULL;
+        case TK_EOF: raise_error("unexpected end of input");
         case TK_INT: return new_int(token.int_val);
         case TK_BOOL: return token.bool_val ? true_obj : false_obj;
         case TK_SYMBOL: return token.sym_val;
-        case TK_STRING: return new_string(token.str_val);
-        case TK_LPAREN: return parse_pair(ls);
+        case TK_STRING: return new_string(interp, token.str_val);
+        case TK_LPAREN: return parse_pair(interp, ls);
         case TK_QUOTE:
-            return cons(quote_symbol,
-                        cons(parse_exp(ls),
+            return cons(interp, interp->quote_symbol,
+                        cons(interp, parse_exp(interp, ls),
                              empty_list));
         default:
-            fprintf(stderr, "unexpected token: %d\n", ls->token.kind);
-            exit(1);
+            raise_error("unexpected token: %d", ls->token.kind);
     }
 }
 
-/* Eval/Apply */
+/* Expand */
+
+// Derived forms are rewritten into core forms once per top-level form,
+// before resolution, so neither engine rebuilds syntax while it runs:
+//   (define (f . params) body...)  => (define f (lambda params body...))
+//   (let ((v e)...) body...)       => ((lambda (v...) body...) e...)
+//   (let* (b bs...) body...)       => (let (b) (let* (bs...) body...))
+//   (letrec ((v e)...) body...)    => (let () (define v e)... body...)
+//   (and e es...)                  => (if e (and es...) #f)
+//   (or e es...)                   => (let ((t e)) (if t t (or es...)))
+// and cond clauses with several body expressions get a begin.
+
+Object* make_lambda(Interp* interp, Object* params, Object* body_exps) {
+    GC_PROTECT(params);
+    Object* result = cons(interp, interp->lambda_symbol, cons(interp, params, body_exps));
+    GC_UNPROTECT(1);
+    return result;
+}
 
-Object* list_of_values(Object* exps, Object* env) {
-    if (exps == empty_list) return empty_list;
+Object* let_vars(Interp* interp, Object* bindings) {
+    if (bindings == empty_list) return empty_list;
+    GC_PROTECT(bindings);
+    Object* result = cons(interp, caar(bindings), let_vars(interp, cdr(bindings)));
+    GC_UNPROTECT(1);
+    return result;
+}
 
-    return cons(eval(car(exps), env),
-                list_of_values(cdr(exps), env));
+Object* let_vals(Interp* interp, Object* bindings) {
+    if (bindings == empty_list) return empty_list;
+    GC_PROTECT(bindings);
+    Object* result = cons(interp, cadar(bindings), let_vals(interp, cdr(bindings)));
+    GC_UNPROTECT(1);
+    return result;
 }
 
-Object* make_lambda(Object* params, Object* body_exps) {
-    return cons(lambda_symbol, cons(params, body_exps));
+bool memq(Object* item, Object* list) {
+    while (list != empty_list) {
+        if (car(list) == item)
+            return true;
+        list = cdr(list);
+    }
+    return false;
 }
 
-Object* let_vars(Object* bindings) {
-    if (bindings == empty_list) return empty_list;
-    return cons(caar(bindings), let_vars(cdr(bindings)));
+Object* append_item(Interp* interp, Object* list, Object* item) {
+    GC_PROTECT(list);
+    Object* tail = cons(interp, item, empty_list);
+    GC_UNPROTECT(1);
+
+    if (list == empty_list)
+        return tail;
+
+    Object* last = list;
+    while (cdr(last) != empty_list)
+        last = cdr(last);
+    last->cdr = tail;
+    return list;
 }
 
-Object* let_vals(Object* bindings) {
-    if (bindings == empty_list) return empty_list;
-    return cons(cadar(bindings), let_vals(cdr(bindings)));
+Object* list3(Interp* interp, Object* a, Object* b, Object* c) {
+    GC_PROTECT(a);
+    GC_PROTECT(b);
+    Object* result = cons(interp, c, empty_list);
+    result = cons(interp, b, result);
+    result = cons(interp, a, result);
+    GC_UNPROTECT(2);
+    return result;
 }
 
-Object* eval(Object* exp, Object* env) {
-    switch (type(exp)) {
-        
-        // self-evaluating
-        case TYPE_BOOL:
-        case TYPE_INT:
-        case TYPE_STRING:
-            return exp;
+Object* expand(Interp* interp, Object* exp);
 
-        case TYPE_SYMBOL:
-            return lookup_variable(exp, env);
+Object* expand_list(Interp* interp, Object* exps) {
+    if (type(exps) != TYPE_PAIR)
+        return exps;
 
-        case TYPE_PAIR: {
-            Object* tag = car(exp);
+    GC_PROTECT(exps);
+    Object* head = expand(interp, car(exps));
+    GC_PROTECT(head);
+    Object* result = cons(interp, head, expand_list(interp, cdr(exps)));
+    GC_UNPROTECT(2);
+    return result;
+}
 
-            if (tag == quote_symbol)
-                return cadr(exp);
+Object* expand(Interp* interp, Object* exp) {
+    if (type(exp) != TYPE_PAIR)
+        return exp;
 
-            if (tag == define_symbol) {
-                Object* name;
-                Object* lambda;
+    Object* result;
+    size_t roots = interp->gc.num_roots;
+    GC_PROTECT(exp);
+    Object* tag = car(exp);
+    SpecialForm form = is_immediate(tag) ? FORM_NONE : tag->form;
+
+    switch (form) {
+        case FORM_QUOTE:
+            result = exp;
+            break;
 
-                if (type(cadr(exp)) == TYPE_PAIR) {
-                    name = caadr(exp);
-                    lambda = make_lambda(cdadr(exp), cddr(exp));
-                } else {
-                    name = cadr(exp);
-                    lambda = caddr(exp);
-                }
-                define_variable(name, eval(lambda, env), env);
-                return ok_symbol;
+        case FORM_DEFINE:
+            if (type(cadr(exp)) == TYPE_PAIR) {
+                Object* lambda = make_lambda(interp, cdadr(exp), cddr(exp));
+                result = expand(interp, list3(interp, interp->define_symbol, caadr(exp), lambda));
+            } else {
+                result = expand_list(interp, exp);
             }
+            break;
 
-            if (tag == set_symbol) {
-                set_variable_value(cadr(exp), eval(caddr(exp), env), env);
-                return ok_symbol;
-            }
+        case FORM_LAMBDA: {
+            Object* body = expand_list(interp, cddr(exp));
+            result = make_lambda(interp, cadr(exp), body);
+            break;
+        }
 
-            if (tag == if_symbol) {
-                if (eval(cadr(exp), env) != false_obj) {
-                    return eval(caddr(exp), env);
-                } else {
-                    if (cdddr(exp) == empty_list)
-                        return false_obj;
+        case FORM_LET: {
+            Object* vars = let_vars(interp, cadr(exp));
+            GC_PROTECT(vars);
+            Object* vals = let_vals(interp, cadr(exp));
+            vals = expand_list(interp, vals);
+            GC_PROTECT(vals);
+            Object* body = expand_list(interp, cddr(exp));
+            Object* lambda = make_lambda(interp, vars, body);
+            result = cons(interp, lambda, vals);
+            break;
+        }
 
-                    Object* alt = cadddr(exp);
-                    return eval(alt, env);
-                }
+        case FORM_LET_STAR: {
+            Object* bindings = cadr(exp);
+            Object* let;
+            if (bindings == empty_list || cdr(bindings) == empty_list) {
+                let = cons(interp, interp->let_symbol, cdr(exp));
+            } else {
+                Object* inner = cons(interp, interp->let_star_symbol,
+                                     cons(interp, cdr(bindings), cddr(exp)));
+                GC_PROTECT(inner);
+                Object* first = cons(interp, car(bindings), empty_list);
+                let = list3(interp, interp->let_symbol, first, inner);
+                GC_UNPROTECT(1);
             }
+            result = expand(interp, let);
+            break;
+        }
 
-            if (tag == cond_symbol) {
-                Object* clauses = cdr(exp);
-                while (car(clauses) != empty_list) {
-                    if (caar(clauses) == else_symbol ||
-                        eval(caar(clauses), env) == true_obj)
-                        return eval(cadar(clauses), env);
-                    clauses = cdr(clauses);
-                }
-                return NULL;
+        case FORM_LETREC: {
+            Object* body = empty_list;
+            GC_PROTECT(body);
+            for (Object* b = cadr(exp); b != empty_list; b = cdr(b)) {
+                Object* define = list3(interp, interp->define_symbol, caar(b), cadar(b));
+                body = append_item(interp, body, define);
             }
-
-            if (tag == lambda_symbol) {
-                Object* params = cadr(exp);
-                Object* body = cddr(exp);
-                return new_procedure(params, body, env);
+            if (body == empty_list) {
+                body = cddr(exp);
+            } else {
+                Object* last = body;
+                while (cdr(last) != empty_list)
+                    last = cdr(last);
+                last->cdr = cddr(exp);
             }
+            Object* let = cons(interp, interp->let_symbol, cons(interp, empty_list, body));
+            result = expand(interp, let);
+            break;
+        }
 
-            if (tag == let_symbol) {
-                Object* bindings = cadr(exp);
-                Object* vars = let_vars(bindings);
-                Object* vals = let_vals(bindings);
-                Object* body_exps = cddr(exp);
-
-                Object* lambda = make_lambda(vars, body_exps);
-                return eval(cons(lambda, vals), env);
+        case FORM_AND:
+        case FORM_OR: {
+            Object* args = cdr(exp);
+            if (args == empty_list) {
+                result = form == FORM_AND ? true_obj : false_obj;
+            } else if (cdr(args) == empty_list) {
+                result = expand(interp, car(args));
+            } else if (form == FORM_AND) {
+                Object* rest = cons(interp, interp->and_symbol, cdr(args));
+                Object* test = list3(interp, car(args), rest, false_obj);
+                result = expand(interp, cons(interp, interp->if_symbol, test));
+            } else {
+                Object* rest = cons(interp, interp->or_symbol, cdr(args));
+                Object* temp = interp->or_temp_symbol;
+                Object* test = cons(interp, interp->if_symbol, list3(interp, temp, temp, rest));
+                GC_PROTECT(test);
+                Object* binding = cons(interp, temp, cons(interp, car(args), empty_list));
+                binding = cons(interp, binding, empty_list);
+                Object* let = list3(interp, interp->let_symbol, binding, test);
+                result = expand(interp, let);
             }
+            break;
+        }
 
-            if (tag == apply_symbol) {
-                Object* proc = eval(cadr(exp), env);
-                Object* args = list_of_values(eval(caddr(exp), env), env);
-                return apply(proc, args);
+        case FORM_COND: {
+            Object* clauses = empty_list;
+            GC_PROTECT(clauses);
+            for (Object* c = cdr(exp); c != empty_list; c = cdr(c)) {
+                Object* body = cdar(c);
+                if (body != empty_list && cdr(body) != empty_list)
+                    body = cons(interp, cons(interp, interp->begin_symbol, body), empty_list);
+                Object* clause = expand_list(interp, cons(interp, caar(c), body));
+                clauses = append_item(interp, clauses, clause);
             }
-
-            // procedure application
-            Object* proc = eval(car(exp), env);
-            Object* args = list_of_values(cdr(exp), env);
-            return apply(proc, args);
+            result = cons(interp, interp->cond_symbol, clauses);
+            break;
         }
+
+        case FORM_NONE:
         default:
-            fprintf(stderr, "unexpected type: [%s]\n", type_names[type(exp)]);
-            exit(1);
+            result = expand_list(interp, exp);
+            break;
     }
+
+    interp->gc.num_roots = roots;
+    return result;
 }
 
-Object* apply(Object* proc, Object* args) {
-    if (type(proc) == TYPE_PRIMITIVE)
-        return proc->func(args);
-    
-    assert(type(proc) == TYPE_PROCEDURE, "expected compound procedure");
-    Object* new_env = extend_environment(proc->params, args, proc->env);
-    Object* body = proc->body;
-    Object* result;
-    while (body != empty_list) {
-        result = eval(car(body), new_env);
-        body = cdr(body);
+/* Resolve */
+
+// collects the names defined directly in a procedure body, skipping quoted
+// data and the bodies of nested lambdas, which get their own frame
+Object* scan_defines(Interp* interp, Object* exp, Object* names) {
+    if (type(exp) != TYPE_PAIR)
+        return names;
+
+    Object* tag = car(exp);
+    SpecialForm form = is_immediate(tag) ? FORM_NONE : tag->form;
+    if (form == FORM_QUOTE || form == FORM_LAMBDA)
+        return names;
+
+    GC_PROTECT(exp);
+    GC_PROTECT(names);
+    if (form == FORM_DEFINE) {
+        if (!memq(cadr(exp), names))
+            names = append_item(interp, names, cadr(exp));
+        names = scan_defines(interp, cddr(exp), names);
+    } else {
+        while (type(exp) == TYPE_PAIR) {
+            names = scan_defines(interp, car(exp), names);
+            exp = cdr(exp);
+        }
     }
+    GC_UNPROTECT(2);
+    return names;
+}
+
+Object* resolve(Interp* interp, Object* exp, Object* scope);
+
+Object* resolve_list(Interp* interp, Object* exps, Object* scope) {
+    if (type(exps) != TYPE_PAIR)
+        return exps;
+
+    GC_PROTECT(exps);
+    GC_PROTECT(scope);
+    Object* head = resolve(interp, car(exps), scope);
+    GC_PROTECT(head);
+    Object* result = cons(interp, head, resolve_list(interp, cdr(exps), scope));
+    GC_UNPROTECT(3);
     return result;
 }
 
-/* Printing */
+Object* resolve_variable(Interp* interp, Object* var, Object* scope) {
+    int depth = 0;
+    for (Object* frames = scope; frames != empty_list; frames = cdr(frames)) {
+        int index = 0;
+        for (Object* vars = car(frames); vars != empty_list; vars = cdr(vars)) {
+            if (car(vars) == var)
+                return new_local_ref(interp, var, depth, index);
+            index++;
+        }
+        depth++;
+    }
+    return new_global_ref(interp, var);
+}
 
-void print_object(Object* obj) {
-    if (!obj) return;
+// (lambda params body...) => (lambda frame-vars resolved-body...), where the
+// frame holds the parameters followed by the body's internal definitions
+Object* resolve_lambda(Interp* interp, Object* params, Object* body, Object* scope) {
+    size_t roots = interp->gc.num_roots;
+    GC_PROTECT(body);
+    GC_PROTECT(scope);
+
+    Object* vars = empty_list;
+    GC_PROTECT(vars);
+    for (Object* p = params; p != empty_list; p = cdr(p))
+        vars = append_item(interp, vars, car(p));
+    vars = scan_defines(interp, body, vars);
+
+    Object* inner = cons(interp, vars, scope);
+    GC_PROTECT(inner);
+    Object* resolved = resolve_list(interp, body, inner);
+    Object* result = make_lambda(interp, vars, resolved);
+    interp->gc.num_roots = roots;
+    return result;
+}
 
-    switch(type(obj)) {
-        case TYPE_INT: printf("%d", obj->int_val); break;
-        case TYPE_BOOL:  printf("%s", obj->bool_val ? "#t" : "#f"); break;
-        case TYPE_STRING: printf("\"%s\"", obj->str_val); break;
-        case TYPE_SYMBOL: printf("%s", obj->str_val); break;
-        case TYPE_EMPTYLIST: printf("()"); break;
-        case TYPE_PROCEDURE:
-        case TYPE_PRIMITIVE: printf("#<procedure>"); break;
-        case TYPE_PAIR:
-            printf("(");
+Object* resolve(Interp* interp, Object* exp, Object* scope) {
+    if (type(exp) == TYPE_SYMBOL)
+        return resolve_variable(interp, exp, scope);
 
-            Object* o = obj;
-            while (type(cdr(o)) == TYPE_PAIR && cdr(o) != empty_list) {
-                print_object(car(o));
-                printf(" ");
-                o = cdr(o);
-            }
+    if (type(exp) != TYPE_PAIR)
+        return exp;
 
-            if (cdr(o) == empty_list) {
-                print_object(car(o));
-            } else {
-                print_object(car(o));
-                printf(" . ");
-                print_object(cdr(o));
+    Object* result;
+    size_t roots = interp->gc.num_roots;
+    GC_PROTECT(exp);
+    GC_PROTECT(scope);
+    Object* tag = car(exp);
+    SpecialForm form = is_immediate(tag) ? FORM_NONE : tag->form;
+
+    switch (form) {
+        case FORM_QUOTE:
+            result = exp;
+            break;
+
+        case FORM_DEFINE:
+        case FORM_SET: {
+            Object* value = resolve(interp, caddr(exp), scope);
+            GC_PROTECT(value);
+            Object* target = resolve_variable(interp, cadr(exp), scope);
+            result = list3(interp, tag, target, value);
+            break;
+        }
+
+        case FORM_LAMBDA:
+            result = resolve_lambda(interp, cadr(exp), cddr(exp), scope);
+            break;
+
+        case FORM_COND: {
+            Object* clauses = empty_list;
+            GC_PROTECT(clauses);
+            for (Object* c = cdr(exp); c != empty_list; c = cdr(c)) {
+                Object* clause = car(c);
+                if (car(clause) == interp->else_symbol) {
+                    Object* body = resolve_list(interp, cdr(clause), scope);
+                    clause = cons(interp, interp->else_symbol, body);
+                } else {
+                    clause = resolve_list(interp, clause, scope);
+                }
+                clauses = append_item(interp, clauses, clause);
             }
-            printf(")");
+            result = cons(interp, interp->cond_symbol, clauses);
+            break;
+        }
+
+        case FORM_IF:
+        case FORM_APPLY:
+        case FORM_BEGIN:
+            result = cons(interp, tag, resolve_list(interp, cdr(exp), scope));
             break;
+
+        case FORM_NONE:
         default:
-            fprintf(stderr, "unexpected type: [%s]\n", type_names[type(obj)]);
-            exit(1);
+            result = resolve_list(interp, exp, scope);
+            break;
+    }
+
+    interp->gc.num_roots = roots;
+    return result;
+}
+
+/* Optimize */
+
+// Runs over a resolved form just before it is evaluated. Branches of an if
+// or cond whose test is a constant are dropped, as are constants whose value
+// a body throws away. A call to a global that holds a primitive becomes
+// (inline op primitive value callee arg...), which checks when it runs that
+// the global still holds that primitive and otherwise makes the call as
+// written. value is the result, worked out now, of a primitive without side
+// effects on constant arguments, or unbound_obj; op is the InlineOp that does
+// the call in place, or -1. A folded call counts as its value to the calls
+// and tests around it, so (+ (* 2 3) 1) folds to 7 and (if (= 1 1) a b)
+// becomes a: only the outermost call keeps its guard, and redefining a
+// primitive it folded through does not reach the branches already dropped.
+
+bool is_constant(Object* exp) {
+    switch (type(exp)) {
+        case TYPE_SYMBOL:
+        case TYPE_LOCALREF:
+        case TYPE_GLOBALREF:
+            return false;
+        case TYPE_PAIR:
+            return !is_immediate(car(exp)) && car(exp)->form == FORM_QUOTE;
+        default:
+            return true;
     }
 }
 
-/* Main */
+Object* constant_value(Object* exp) {
+    return type(exp) == TYPE_PAIR ? cadr(exp) : exp;
+}
+
+// the value an optimized expression is known to have: a constant's, or that
+// of a call folded when it was optimized; unbound_obj if it has none
+Object* folded_value(Object* exp) {
+    if (is_constant(exp))
+        return constant_value(exp);
+    if (type(exp) == TYPE_PAIR && !is_immediate(car(exp)) && car(exp)->form == FORM_INLINE)
+        return cadddr(exp);
+    return unbound_obj;
+}
 
-void eval_all(LexState* ls, bool verbose) {
-    next_token(ls);
-    while (ls->token.kind != TK_EOF) {
-        Object* exp = parse_exp(ls);
-        Object* result = eval(exp, global_env);
-        if (result && verbose) {
-            print_object(result);
-            printf("\n");
+// whether prim can be called on the constant args now: it has no side
+// effects and takes the arguments without error
+bool can_fold(Object* prim, int argc, Object** args) {
+    Object* (*func)(Interp*, int, Object**) = prim->func;
+    if (!primitive_accepts(prim, argc))
+        return false;
+
+    if (func == _proc_add || func == _proc_sub || func == _proc_mul || func == _proc_div ||
+        func == _proc_equals || func == _proc_less_than) {
+        for (int i = 0; i < argc; i++) {
+            if (!is_fixnum(args[i]) || (func == _proc_div && i > 0 && fixnum_val(args[i]) == 0))
+                return false;
         }
+        return true;
     }
+    if (func == _proc_car || func == _proc_cdr)
+        return type(args[0]) == TYPE_PAIR;
+    return func == _proc_is_null || func == _proc_is_eq || func == _proc_is_pair ||
+           func == _proc_is_number || func == _proc_is_string || func == _proc_is_symbol;
 }
 
-void skip_repl_space(FILE* stream) {
-    int c = getc(stream);
-    while (c == ' ') {
-        c = getc(stream);
+int inline_op(Object* prim, int argc) {
+    for (size_t i = 0; i < NUM_INLINE_OPS; i++) {
+        if (inline_ops[i].func == prim->func && inline_ops[i].argc == argc)
+            return i;
     }
-    ungetc(c, stream);
+    return -1;
 }
 
-int main(int argc, char** argv) {
-    init();
-    
-    LexState ls = {};
-    if (argc == 3 && !strncmp(argv[1], "-f", 2)) {
-        FILE* file = fopen(argv[2], "r");
-        if (file == NULL) {
-            fprintf(stderr, "could not open file: %s\n", argv[2]);
-            exit(1);
-        }
+// exps is an optimized call (callee arg...)
+Object* optimize_call(Interp* interp, Object* exps) {
+    Object* callee = car(exps);
+    if (type(callee) != TYPE_GLOBALREF || type(callee->name->value) != TYPE_PRIMITIVE)
+        return exps;
+
+    Object* prim = callee->name->value;
+    int argc = 0;
+    bool constant = true;
+    for (Object* e = cdr(exps); e != empty_list; e = cdr(e)) {
+        constant = constant && folded_value(car(e)) != unbound_obj;
+        argc++;
+    }
 
-        ls.stream = file;
-        eval_all(&ls, true);
-        fclose(file);
+    Object* value = unbound_obj;
+    if (constant) {
+        Object* args[argc > 0 ? argc : 1];
+        int i = 0;
+        for (Object* e = cdr(exps); e != empty_list; e = cdr(e))
+            args[i++] = folded_value(car(e));
+        if (can_fold(prim, argc, args))
+            value = prim->func(interp, argc, args);
+    }
+
+    int op = inline_op(prim, argc);
+    if (value == unbound_obj && op < 0)
+        return exps;
+
+    GC_PROTECT(exps);
+    GC_PROTECT(prim);
+    Object* result = cons(interp, value, exps);
+    result = cons(interp, prim, result);
+    result = cons(interp, new_int(op), result);
+    result = cons(interp, interp->inline_symbol, result);
+    GC_UNPROTECT(2);
+    return result;
+}
+
+Object* optimize(Interp* interp, Object* exp);
+
+Object* optimize_list(Interp* interp, Object* exps) {
+    if (type(exps) != TYPE_PAIR)
+        return exps;
+
+    GC_PROTECT(exps);
+    Object* head = optimize(interp, car(exps));
+    GC_PROTECT(head);
+    Object* result = cons(interp, head, optimize_list(interp, cdr(exps)));
+    GC_UNPROTECT(2);
+    return result;
+}
+
+// like optimize_list, leaving out constants other than the last expression
+Object* optimize_body(Interp* interp, Object* body) {
+    if (body == empty_list)
+        return empty_list;
+
+    GC_PROTECT(body);
+    Object* head = optimize(interp, car(body));
+    GC_PROTECT(head);
+    Object* rest = optimize_body(interp, cdr(body));
+    Object* result = rest != empty_list && is_constant(head) ? rest : cons(interp, head, rest);
+    GC_UNPROTECT(2);
+    return result;
+}
+
+Object* optimize_if(Interp* interp, Object* exp) {
+    size_t roots = interp->gc.num_roots;
+    GC_PROTECT(exp);
+    Object* test = optimize(interp, cadr(exp));
+    GC_PROTECT(test);
+
+    Object* result;
+    Object* value = folded_value(test);
+    if (value != unbound_obj) {
+        if (value != false_obj)
+            result = optimize(interp, caddr(exp));
+        else if (cdddr(exp) == empty_list)
+            result = false_obj;
+        else
+            result = optimize(interp, cadddr(exp));
     } else {
-        printf("Welcome to Bootstrap Scheme\n\n");
-        
-        while (true) {
-            char buf[BUF_MAX];
-            size_t len = 0;
-            
-            printf("> ");
-            int c = getc(stdin);
-            while (c != '\n') {
-                if (len == BUF_MAX - 1) {
-                    fprintf(stderr, "exceeded max buffer length\n");
-                    exit(1);
-                }
+        result = cons(interp, test, optimize_list(interp, cddr(exp)));
+        result = cons(interp, car(exp), result);
+    }
 
-                buf[len++] = c;
-                c = getc(stdin);
+    interp->gc.num_roots = roots;
+    return result;
+}
+
+// a clause whose test is a constant other than #t is never taken, and one
+// whose test is #t becomes the else clause
+Object* optimize_cond(Interp* interp, Object* exp) {
+    size_t roots = interp->gc.num_roots;
+    GC_PROTECT(exp);
+    Object* clauses = empty_list;
+    GC_PROTECT(clauses);
+    Object* test = NULL;
+    GC_PROTECT(test);
+
+    Object* result = NULL;
+    for (Object* c = cdr(exp); c != empty_list; c = cdr(c)) {
+        test = car(car(c));
+        if (test != interp->else_symbol) {
+            test = optimize(interp, test);
+            Object* value = folded_value(test);
+            if (value != unbound_obj) {
+                if (value != true_obj)
+                    continue;
+                test = interp->else_symbol;
             }
-            buf[len++] = '\n';
+        }
 
-            FILE* stream = fmemopen(buf, len, "r");
-            ls.stream = stream;
-            eval_all(&ls, true);
-            fclose(stream);
+        Object* body = optimize_list(interp, cdr(car(c)));
+        if (test == interp->else_symbol && clauses == empty_list) {
+            result = car(body);
+            break;
         }
+        clauses = append_item(interp, clauses, cons(interp, test, body));
+        if (test == interp->else_symbol)
+            break;
     }
+    if (result == NULL)
+        result = cons(interp, car(exp), clauses);
+
+    interp->gc.num_roots = roots;
+    return result;
+}
+
+Object* optimize(Interp* interp, Object* exp) {
+    if (type(exp) != TYPE_PAIR)
+        return exp;
+
+    Object* result;
+    size_t roots = interp->gc.num_roots;
+    GC_PROTECT(exp);
+    Object* tag = car(exp);
+    SpecialForm form = is_immediate(tag) ? FORM_NONE : tag->form;
+
+    switch (form) {
+        case FORM_QUOTE:
+        case FORM_INLINE:
+            result = exp;
+            break;
+
+        case FORM_DEFINE:
+        case FORM_SET: {
+            Object* value = optimize(interp, caddr(exp));
+            result = list3(interp, tag, cadr(exp), value);
+            break;
+        }
+
+        case FORM_LAMBDA: {
+            Object* body = optimize_body(interp, cddr(exp));
+            result = make_lambda(interp, cadr(exp), body);
+            break;
+        }
+
+        case FORM_IF:
+            result = optimize_if(interp, exp);
+            break;
+
+        case FORM_COND:
+            result = optimize_cond(interp, exp);
+            break;
+
+        case FORM_BEGIN: {
+            Object* body = optimize_body(interp, cdr(exp));
+            result = body != empty_list && cdr(body) == empty_list ? car(body) : cons(interp, tag, body);
+            break;
+        }
+
+        case FORM_APPLY:
+            result = cons(interp, tag, optimize_list(interp, cdr(exp)));
+            break;
+
+        case FORM_NONE:
+        default:
+            result = optimize_call(interp, optimize_list(interp, exp));
+            break;
+    }
+
+    interp->gc.num_roots = roots;
+    return result;
+}
+
+/* Eval/Apply */
+
+// Expressions are analyzed once into a tree of nodes that each hold the
+// C function that runs them (SICP 4.1.7), so running a procedure body does
+// not take the s-expression apart again. Nodes in tail position return
+// tail_call_obj after storing the next node and environment in the
+// ExecState, and execute loops on them instead of recursing.
+
+Object* execute(Interp* interp, Object* node, Object* env) {
+    RuntimeStats* counters = &interp->counters;
+    ExecState k = {node, env, interp->profiler.depth};
+    if ((char*)&k < stack_limit)
+        raise_error("stack overflow");
+    GC_PROTECT(k.node);
+    GC_PROTECT(k.env);
+    if (++counters->depth > counters->max_depth)
+        counters->max_depth = counters->depth;
+
+    Object* result;
+    do {
+        counters->evals++;
+        result = k.node->exec(interp, k.node, &k);
+    } while (result == tail_call_obj);
+
+    if (interp->profiler.enabled)
+        profile_unwind(interp, k.profile_depth);
+    counters->depth--;
+    GC_UNPROTECT(2);
+    return result;
+}
+
+Object* new_node(Interp* interp, Object* (*exec)(Interp*, Object*, ExecState*),
+                 Object* operand, int num_children) {
+    GC_PROTECT(operand);
+    Object* node = allocate(interp, TYPE_NODE,
+                            offsetof(Object, children) + num_children * sizeof(Object*));
+    GC_UNPROTECT(1);
+
+    node->exec = exec;
+    node->operand = operand;
+    node->op_depth = 0;
+    node->op_index = 0;
+    node->num_children = num_children;
+    for (int i = 0; i < num_children; i++)
+        node->children[i] = NULL;
+    return node;
+}
+
+Object* exec_const(Interp* interp, Object* node, ExecState* k) {
+    (void)interp;
+    (void)k;
+    return node->operand;
+}
+
+Object* exec_lookup(Interp* interp, Object* node, ExecState* k) {
+    return lookup_variable(interp, node->operand, k->env);
+}
+
+Object* exec_local(Interp* interp, Object* node, ExecState* k) {
+    (void)interp;
+    Object* value = *local_slot(k->env, node->op_depth, node->op_index);
+    if (value == unbound_obj)
+        unbound_local(k->env, node->op_depth, node->op_index);
+    return value;
+}
+
+Object* exec_global(Interp* interp, Object* node, ExecState* k) {
+    (void)interp;
+    (void)k;
+    Object* value = __atomic_load_n(&node->operand->value, __ATOMIC_ACQUIRE);
+    if (value == unbound_obj)
+        unbound_global(node->operand);
+    return value;
+}
+
+Object* exec_define_local(Interp* interp, Object* node, ExecState* k) {
+    Object* value = execute(interp, node->children[0], k->env);
+    name_procedure(value, slot_name(k->env, node->op_depth, node->op_index));
+    *local_slot(k->env, node->op_depth, node->op_index) = value;
+    return interp->ok_symbol;
+}
+
+Object* exec_set_local(Interp* interp, Object* node, ExecState* k) {
+    Object* value = execute(interp, node->children[0], k->env);
+    Object** slot = local_slot(k->env, node->op_depth, node->op_index);
+    if (*slot == unbound_obj)
+        unbound_local(k->env, node->op_depth, node->op_index);
+    *slot = value;
+    return interp->ok_symbol;
+}
+
+Object* exec_define_global(Interp* interp, Object* node, ExecState* k) {
+    Object* value = execute(interp, node->children[0], k->env);
+    name_procedure(value, node->operand);
+    set_global(interp, node->operand, value);
+    return interp->ok_symbol;
+}
+
+Object* exec_set_global(Interp* interp, Object* node, ExecState* k) {
+    Object* value = execute(interp, node->children[0], k->env);
+    if (node->operand->value == unbound_obj)
+        unbound_global(node->operand);
+    set_global(interp, node->operand, value);
+    return interp->ok_symbol;
+}
+
+Object* exec_define_name(Interp* interp, Object* node, ExecState* k) {
+    Object* value = execute(interp, node->children[0], k->env);
+    name_procedure(value, node->operand);
+    define_variable(interp, node->operand, value, k->env);
+    return interp->ok_symbol;
+}
+
+Object* exec_set_name(Interp* interp, Object* node, ExecState* k) {
+    set_variable_value(interp, node->operand, execute(interp, node->children[0], k->env), k->env);
+    return interp->ok_symbol;
+}
+
+Object* exec_if(Interp* interp, Object* node, ExecState* k) {
+    if (execute(interp, node->children[0], k->env) != false_obj)
+        k->node = node->children[1];
+    else
+        k->node = node->children[2];
+    return tail_call_obj;
+}
+
+// children are test/body pairs, with a NULL test for else
+Object* exec_cond(Interp* interp, Object* node, ExecState* k) {
+    for (int i = 0; i < node->num_children; i += 2) {
+        Object* test = node->children[i];
+        if (test == NULL || execute(interp, test, k->env) == true_obj) {
+            k->node = node->children[i + 1];
+            return tail_call_obj;
+        }
+    }
+    return NULL;
+}
+
+Object* exec_sequence(Interp* interp, Object* node, ExecState* k) {
+    int last = node->num_children - 1;
+    for (int i = 0; i < last; i++)
+        execute(interp, node->children[i], k->env);
+    k->node = node->children[last];
+    return tail_call_obj;
+}
+
+Object* analyze_lambda(Interp* interp, Object* lambda);
+
+Object* exec_lambda(Interp* interp, Object* node, ExecState* k) {
+    Object* lambda = node->operand;
+    Object* proc = new_procedure(interp, cadr(lambda), cddr(lambda), k->env);
+    proc->code = node->children[0];
+    return proc;
+}
+
+Object* procedure_node(Interp* interp, Object* proc) {
+    if (proc->code == NULL || type(proc->code) != TYPE_NODE) {
+        GC_PROTECT(proc);
+        Object* lambda = make_lambda(interp, proc->params, proc->body);
+        Object* body = analyze_lambda(interp, lambda);
+        proc->code = body;
+        GC_UNPROTECT(1);
+    }
+    return proc->code;
+}
+
+// enters a compound procedure: the caller has filled the frame's slots
+Object* enter_procedure(Interp* interp, Object* proc, Object* frame, ExecState* k) {
+    GC_PROTECT(frame);
+    k->node = procedure_node(interp, proc);
+    k->env = frame;
+    GC_UNPROTECT(1);
+    interp->counters.calls++;
+    if (interp->profiler.enabled) {
+        profile_unwind(interp, k->profile_depth);
+        profile_enter(interp, proc);
+    }
+    return tail_call_obj;
+}
+
+// calls proc with the values of the node's children from first on
+Object* call_node(Interp* interp, Object* proc, Object* node, int first, ExecState* k) {
+    size_t roots = interp->gc.num_roots;
+    GC_PROTECT(proc);
+    Object* result;
+
+    if (type(proc) == TYPE_PROCEDURE) {
+        // arguments go straight into the new frame's slots
+        Object* frame = new_frame(interp, proc->params, proc->frame_size, proc->env);
+        GC_PROTECT(frame);
+        for (int i = first; i < node->num_children; i++) {
+            Object* value = execute(interp, node->children[i], k->env);
+            if (i - first < frame->num_slots)
+                frame->slots[i - first] = value;
+        }
+        result = enter_procedure(interp, proc, frame, k);
+    } else {
+        assert(type(proc) == TYPE_PRIMITIVE, "expected procedure");
+        int argc = node->num_children - first;
+        if (argc <= 2) {
+            // the common one and two argument calls use a fixed array
+            Object* argv[2] = {NULL, NULL};
+            GC_PROTECT(argv[0]);
+            GC_PROTECT(argv[1]);
+            for (int i = 0; i < argc; i++)
+                argv[i] = execute(interp, node->children[i + first], k->env);
+            result = call_primitive(interp, proc, argc, argv);
+        } else {
+            Object* argv[argc];
+            for (int i = 0; i < argc; i++) {
+                argv[i] = NULL;
+                GC_PROTECT(argv[i]);
+            }
+            for (int i = 0; i < argc; i++)
+                argv[i] = execute(interp, node->children[i + first], k->env);
+            result = call_primitive(interp, proc, argc, argv);
+        }
+    }
+
+    interp->gc.num_roots = roots;
+    return result;
+}
+
+Object* exec_call(Interp* interp, Object* node, ExecState* k) {
+    Object* proc = execute(interp, node->children[0], k->env);
+    return call_node(interp, proc, node, 1, k);
+}
+
+// a call to a global reads the symbol's value directly instead of running
+// the operator's node
+Object* exec_call_global(Interp* interp, Object* node, ExecState* k) {
+    Object* proc = __atomic_load_n(&node->operand->value, __ATOMIC_ACQUIRE);
+    if (proc == unbound_obj)
+        unbound_global(node->operand);
+    return call_node(interp, proc, node, 1, k);
+}
+
+// (inline ...), see Optimize: the operand is the callee's symbol and the
+// first child the primitive it held. Folded calls keep their value in the
+// second child, and the arguments follow
+Object* exec_inline(Interp* interp, Object* node, ExecState* k) {
+    Object* proc = __atomic_load_n(&node->operand->value, __ATOMIC_ACQUIRE);
+    if (proc != node->children[0]) {
+        if (proc == unbound_obj)
+            unbound_global(node->operand);
+        return call_node(interp, proc, node, 1, k);
+    }
+
+    Object* args[2] = {NULL, NULL};
+    GC_PROTECT(args[0]);
+    GC_PROTECT(args[1]);
+    for (int i = 1; i < node->num_children; i++)
+        args[i - 1] = execute(interp, node->children[i], k->env);
+    Object* result = run_inline(interp, node->op_index, args);
+    GC_UNPROTECT(2);
+    return result;
+}
+
+Object* exec_folded(Interp* interp, Object* node, ExecState* k) {
+    Object* proc = node->operand->value;
+    if (proc == node->children[0])
+        return node->children[1];
+    if (proc == unbound_obj)
+        unbound_global(node->operand);
+    return call_node(interp, proc, node, 2, k);
+}
+
+Object* exec_apply(Interp* interp, Object* node, ExecState* k) {
+    size_t roots = interp->gc.num_roots;
+    Object* proc = execute(interp, node->children[0], k->env);
+    GC_PROTECT(proc);
+    Object* args = execute(interp, node->children[1], k->env);
+    GC_PROTECT(args);
+
+    Object* result;
+    if (type(proc) == TYPE_PROCEDURE) {
+        Object* frame = extend_environment(interp, proc->params, proc->frame_size, args, proc->env);
+        result = enter_procedure(interp, proc, frame, k);
+    } else {
+        assert(type(proc) == TYPE_PRIMITIVE, "expected procedure");
+        result = apply(interp, proc, args);
+    }
+
+    interp->gc.num_roots = roots;
+    return result;
+}
+
+Object* analyze(Interp* interp, Object* exp);
+
+Object* analyze_body(Interp* interp, Object* body) {
+    if (body == empty_list)
+        return new_node(interp, exec_const, NULL, 0);
+    if (cdr(body) == empty_list)
+        return analyze(interp, car(body));
+
+    int count = 0;
+    for (Object* b = body; b != empty_list; b = cdr(b))
+        count++;
+
+    GC_PROTECT(body);
+    Object* node = new_node(interp, exec_sequence, NULL, count);
+    GC_PROTECT(node);
+    for (int i = 0; i < count; i++) {
+        Object* child = analyze(interp, car(body));
+        node->children[i] = child;
+        body = cdr(body);
+    }
+    GC_UNPROTECT(2);
+    return node;
+}
+
+Object* analyze_lambda(Interp* interp, Object* lambda) {
+    return analyze_body(interp, cddr(lambda));
+}
+
+Object* analyze_variable_op(Interp* interp, Object* target, Object* value,
+                            Object* (*local)(Interp*, Object*, ExecState*),
+                            Object* (*global)(Interp*, Object*, ExecState*),
+                            Object* (*name)(Interp*, Object*, ExecState*)) {
+    GC_PROTECT(value);
+    Object* node;
+    switch (type(target)) {
+        case TYPE_LOCALREF:
+            node = new_node(interp, local, NULL, 1);
+            node->op_depth = target->depth;
+            node->op_index = target->index;
+            break;
+        case TYPE_GLOBALREF:
+            node = new_node(interp, global, target->name, 1);
+            break;
+        default:
+            node = new_node(interp, name, target, 1);
+            break;
+    }
+    node->children[0] = value;
+    GC_UNPROTECT(1);
+    return node;
+}
+
+Object* analyze_call(Interp* interp, Object* exps) {
+    int count = 0;
+    for (Object* e = exps; e != empty_list; e = cdr(e))
+        count++;
+
+    GC_PROTECT(exps);
+    Object* callee = car(exps);
+    Object* node = type(callee) == TYPE_GLOBALREF
+                   ? new_node(interp, exec_call_global, callee->name, count)
+                   : new_node(interp, exec_call, NULL, count);
+    GC_PROTECT(node);
+    for (int i = 0; i < count; i++) {
+        Object* child = analyze(interp, car(exps));
+        node->children[i] = child;
+        exps = cdr(exps);
+    }
+    GC_UNPROTECT(2);
+    return node;
+}
+
+// (inline op primitive value callee arg...), see Optimize
+Object* analyze_inline(Interp* interp, Object* exp) {
+    Object* value = cadddr(exp);
+    Object* args = cdr(cdr(cdddr(exp)));
+    int first = value == unbound_obj ? 1 : 2;
+    int count = first;
+    for (Object* a = args; a != empty_list; a = cdr(a))
+        count++;
+
+    GC_PROTECT(args);
+    Object* node = new_node(interp, first == 1 ? exec_inline : exec_folded,
+                            car(cdr(cdddr(exp)))->name, count);
+    node->op_index = fixnum_val(cadr(exp));
+    node->children[0] = caddr(exp);
+    if (first == 2)
+        node->children[1] = value;
+    GC_PROTECT(node);
+    for (int i = first; i < count; i++) {
+        Object* child = analyze(interp, car(args));
+        node->children[i] = child;
+        args = cdr(args);
+    }
+    GC_UNPROTECT(2);
+    return node;
+}
+
+Object* analyze(Interp* interp, Object* exp) {
+    switch (type(exp)) {
+        case TYPE_SYMBOL:
+            return new_node(interp, exec_lookup, exp, 0);
+
+        case TYPE_LOCALREF: {
+            Object* node = new_node(interp, exec_local, NULL, 0);
+            node->op_depth = exp->depth;
+            node->op_index = exp->index;
+            return node;
+        }
+
+        case TYPE_GLOBALREF:
+            return new_node(interp, exec_global, exp->name, 0);
+
+        case TYPE_PAIR:
+            break;
+
+        default:
+            return new_node(interp, exec_const, exp, 0);
+    }
+
+    Object* node;
+    size_t roots = interp->gc.num_roots;
+    GC_PROTECT(exp);
+    Object* tag = car(exp);
+    SpecialForm form = is_immediate(tag) ? FORM_NONE : tag->form;
+
+    switch (form) {
+        case FORM_QUOTE:
+            node = new_node(interp, exec_const, cadr(exp), 0);
+            break;
+
+        case FORM_DEFINE:
+        case FORM_SET: {
+            Object* target = cadr(exp);
+            Object* value = analyze(interp, caddr(exp));
+
+            if (form == FORM_DEFINE)
+                node = analyze_variable_op(interp, target, value, exec_define_local,
+                                           exec_define_global, exec_define_name);
+            else
+                node = analyze_variable_op(interp, target, value, exec_set_local,
+                                           exec_set_global, exec_set_name);
+            break;
+        }
+
+        case FORM_IF: {
+            node = new_node(interp, exec_if, NULL, 3);
+            GC_PROTECT(node);
+            Object* child = analyze(interp, cadr(exp));
+            node->children[0] = child;
+            child = analyze(interp, caddr(exp));
+            node->children[1] = child;
+            if (cdddr(exp) == empty_list)
+                child = new_node(interp, exec_const, false_obj, 0);
+            else
+                child = analyze(interp, cadddr(exp));
+            node->children[2] = child;
+            break;
+        }
+
+        case FORM_COND: {
+            int count = 0;
+            for (Object* c = cdr(exp); c != empty_list; c = cdr(c))
+                count++;
+
+            node = new_node(interp, exec_cond, NULL, count * 2);
+            GC_PROTECT(node);
+            Object* clauses = cdr(exp);
+            for (int i = 0; i < count; i++) {
+                Object* clause = car(clauses);
+                if (car(clause) != interp->else_symbol) {
+                    Object* test = analyze(interp, car(clause));
+                    node->children[i * 2] = test;
+                }
+                Object* body = analyze(interp, cadr(clause));
+                node->children[i * 2 + 1] = body;
+                clauses = cdr(clauses);
+            }
+            break;
+        }
+
+        case FORM_LAMBDA: {
+            node = new_node(interp, exec_lambda, exp, 1);
+            GC_PROTECT(node);
+            Object* body = analyze_lambda(interp, exp);
+            node->children[0] = body;
+            break;
+        }
+
+        case FORM_BEGIN:
+            node = analyze_body(interp, cdr(exp));
+            break;
+
+        case FORM_APPLY: {
+            node = new_node(interp, exec_apply, NULL, 2);
+            GC_PROTECT(node);
+            Object* child = analyze(interp, cadr(exp));
+            node->children[0] = child;
+            child = analyze(interp, caddr(exp));
+            node->children[1] = child;
+            break;
+        }
+
+        case FORM_INLINE:
+            node = analyze_inline(interp, exp);
+            break;
+
+        case FORM_NONE:
+        default:
+            node = analyze_call(interp, exp);
+            break;
+    }
+
+    interp->gc.num_roots = roots;
+    return node;
+}
+
+Object* eval(Interp* interp, Object* exp, Object* env) {
+    GC_PROTECT(env);
+    Object* node = analyze(interp, exp);
+    Object* result = execute(interp, node, env);
+    GC_UNPROTECT(1);
+    return result;
+}
+
+Object* apply(Interp* interp, Object* proc, Object* args) {
+    if (type(proc) == TYPE_PRIMITIVE) {
+        // spread the list into an array; args keeps the values rooted
+        interp->counters.argument_lists++;
+        int argc = 0;
+        for (Object* a = args; a != empty_list; a = cdr(a))
+            argc++;
+        Object* argv[argc > 0 ? argc : 1];
+        for (int i = 0; i < argc; i++) {
+            argv[i] = car(args);
+            args = cdr(args);
+        }
+        return call_primitive(interp, proc, argc, argv);
+    }
+
+    assert(type(proc) == TYPE_PROCEDURE, "expected compound procedure");
+    GC_PROTECT(proc);
+    Object* env = extend_environment(interp, proc->params, proc->frame_size, args, proc->env);
+    GC_PROTECT(env);
+    Object* result = execute(interp, procedure_node(interp, proc), env);
+    GC_UNPROTECT(2);
+    return result;
+}
+
+/* Compile */
+
+void emit(Compiler* c, int32_t word) {
+    if (c->num_instrs == c->instrs_capacity) {
+        c->instrs_capacity = c->instrs_capacity ? c->instrs_capacity * 2 : 32;
+        c->instrs = realloc(c->instrs, c->instrs_capacity * sizeof(int32_t));
+        assert(c->instrs != NULL, "out of memory");
+    }
+    c->instrs[c->num_instrs++] = word;
+}
+
+void emit_op(Compiler* c, Opcode op, int32_t operand) {
+    emit(c, op);
+    emit(c, operand);
+}
+
+// emits a jump with a placeholder target and returns where to patch it
+int emit_jump(Compiler* c, Opcode op) {
+    emit_op(c, op, -1);
+    return c->num_instrs - 1;
+}
+
+void patch_jump(Compiler* c, int at) {
+    c->instrs[at] = c->num_instrs;
+}
+
+int add_const(Compiler* c, Object* value) {
+    for (int i = 0; i < c->num_consts; i++) {
+        if (c->consts[i] == value)
+            return i;
+    }
+
+    if (c->num_consts == c->consts_capacity) {
+        c->consts_capacity = c->consts_capacity ? c->consts_capacity * 2 : 8;
+        c->consts = realloc(c->consts, c->consts_capacity * sizeof(Object*));
+        assert(c->consts != NULL, "out of memory");
+    }
+    c->consts[c->num_consts] = value;
+    return c->num_consts++;
+}
+
+void begin_compiler(Interp* interp, Compiler* c) {
+    *c = (Compiler){0};
+    c->parent = interp->compilers;
+    interp->compilers = c;
+}
+
+Object* end_compiler(Interp* interp, Compiler* c, Object* lambda) {
+    GC_PROTECT(lambda);
+    Object* code = new_object(interp, TYPE_CODE);
+    GC_UNPROTECT(1);
+
+    interp->compilers = c->parent;
+    code->instrs = c->instrs;
+    code->num_instrs = c->num_instrs;
+    code->consts = c->consts;
+    code->num_consts = c->num_consts;
+    code->caches = calloc(c->num_caches, sizeof(CallCache));
+    assert(code->caches != NULL || c->num_caches == 0, "out of memory");
+    code->num_caches = c->num_caches;
+    code->lambda = lambda;
+    code->entries = 0;
+    code->deopts = 0;
+    code->native = NULL;
+    return code;
+}
+
+void compile(Interp* interp, Compiler* c, Object* exp, bool tail);
+
+void compile_body(Interp* interp, Compiler* c, Object* body, bool tail) {
+    if (body == empty_list) {
+        emit_op(c, OP_CONST, add_const(c, NULL));
+        return;
+    }
+
+    while (cdr(body) != empty_list) {
+        compile(interp, c, car(body), false);
+        emit(c, OP_POP);
+        body = cdr(body);
+    }
+    compile(interp, c, car(body), tail);
+}
+
+Object* compile_lambda(Interp* interp, Object* lambda) {
+    GC_PROTECT(lambda);
+    Compiler c;
+    begin_compiler(interp, &c);
+    compile_body(interp, &c, cddr(lambda), true);
+    emit(&c, OP_RETURN);
+    Object* code = end_compiler(interp, &c, lambda);
+    GC_UNPROTECT(1);
+    return code;
+}
+
+Object* compile_toplevel(Interp* interp, Object* exp) {
+    GC_PROTECT(exp);
+    Compiler c;
+    begin_compiler(interp, &c);
+    compile(interp, &c, exp, true);
+    emit(&c, OP_RETURN);
+    Object* code = end_compiler(interp, &c, NULL);
+    GC_UNPROTECT(1);
+    return code;
+}
+
+void compile_variable_op(Compiler* c, Object* target, Opcode local, Opcode global, Opcode name) {
+    switch (type(target)) {
+        case TYPE_LOCALREF:
+            emit_op(c, local, target->depth);
+            emit(c, target->index);
+            break;
+        case TYPE_GLOBALREF:
+            emit_op(c, global, add_const(c, target->name));
+            break;
+        default:
+            emit_op(c, name, add_const(c, target));
+            break;
+    }
+}
+
+// a call to a global leaves the operator to the call instruction, which
+// reads it through the site's cache
+void compile_call(Interp* interp, Compiler* c, Object* exps, bool tail) {
+    Object* callee = car(exps);
+    bool global = type(callee) == TYPE_GLOBALREF;
+    int argc = 0;
+    if (global)
+        exps = cdr(exps);
+    else
+        argc--;
+    while (exps != empty_list) {
+        compile(interp, c, car(exps), false);
+        exps = cdr(exps);
+        argc++;
+    }
+    if (global) {
+        emit_op(c, tail ? OP_TAIL_CALL_GLOBAL : OP_CALL_GLOBAL, add_const(c, callee->name));
+        emit(c, argc);
+        emit(c, c->num_caches++);
+    } else {
+        emit_op(c, tail ? OP_TAIL_CALL : OP_CALL, argc);
+    }
+}
+
+void compile(Interp* interp, Compiler* c, Object* exp, bool tail) {
+    switch (type(exp)) {
+        case TYPE_SYMBOL:
+            emit_op(c, OP_LOOKUP, add_const(c, exp));
+            return;
+
+        case TYPE_LOCALREF:
+        case TYPE_GLOBALREF:
+            compile_variable_op(c, exp, OP_LOCAL, OP_GLOBAL, OP_LOOKUP);
+            return;
+
+        case TYPE_PAIR:
+            break;
+
+        default:
+            emit_op(c, OP_CONST, add_const(c, exp));
+            return;
+    }
+
+    size_t roots = interp->gc.num_roots;
+    GC_PROTECT(exp);
+    Object* tag = car(exp);
+    SpecialForm form = is_immediate(tag) ? FORM_NONE : tag->form;
+
+    switch (form) {
+        case FORM_QUOTE:
+            emit_op(c, OP_CONST, add_const(c, cadr(exp)));
+            break;
+
+        case FORM_DEFINE:
+        case FORM_SET: {
+            Object* target = cadr(exp);
+            compile(interp, c, caddr(exp), false);
+
+            if (form == FORM_DEFINE)
+                compile_variable_op(c, target, OP_DEFINE_LOCAL, OP_DEFINE_GLOBAL, OP_DEFINE_NAME);
+            else
+                compile_variable_op(c, target, OP_SET_LOCAL, OP_SET_GLOBAL, OP_SET_NAME);
+            break;
+        }
+
+        case FORM_IF: {
+            compile(interp, c, cadr(exp), false);
+            int to_else = emit_jump(c, OP_JUMP_IF_FALSE);
+            compile(interp, c, caddr(exp), tail);
+            int to_end = emit_jump(c, OP_JUMP);
+            patch_jump(c, to_else);
+            if (cdddr(exp) == empty_list)
+                emit_op(c, OP_CONST, add_const(c, false_obj));
+            else
+                compile(interp, c, cadddr(exp), tail);
+            patch_jump(c, to_end);
+            break;
+        }
+
+        case FORM_COND: {
+            // each matching clause jumps to the end; the chain of jumps is
+            // threaded through the placeholder targets until it is patched
+            int to_end = -1;
+            for (Object* clauses = cdr(exp); clauses != empty_list; clauses = cdr(clauses)) {
+                Object* clause = car(clauses);
+                int to_next = -1;
+                if (car(clause) != interp->else_symbol) {
+                    compile(interp, c, car(clause), false);
+                    to_next = emit_jump(c, OP_JUMP_UNLESS_TRUE);
+                }
+                compile(interp, c, cadr(clause), tail);
+                int jump = emit_jump(c, OP_JUMP);
+                c->instrs[jump] = to_end;
+                to_end = jump;
+                if (to_next < 0)
+                    break;
+                patch_jump(c, to_next);
+            }
+            emit_op(c, OP_CONST, add_const(c, NULL));
+            while (to_end >= 0) {
+                int next = c->instrs[to_end];
+                patch_jump(c, to_end);
+                to_end = next;
+            }
+            break;
+        }
+
+        case FORM_LAMBDA: {
+            Object* code = compile_lambda(interp, exp);
+            emit_op(c, OP_CLOSURE, add_const(c, code));
+            break;
+        }
+
+        case FORM_BEGIN:
+            compile_body(interp, c, cdr(exp), tail);
+            break;
+
+        case FORM_APPLY:
+            compile(interp, c, cadr(exp), false);
+            compile(interp, c, caddr(exp), false);
+            emit(c, tail ? OP_TAIL_APPLY : OP_APPLY);
+            break;
+
+        case FORM_INLINE: {
+            // (inline op primitive value callee arg...), see Optimize
+            int op = fixnum_val(cadr(exp));
+            Object* value = cadddr(exp);
+            Object* call = cdr(cdddr(exp));
+            int symbol = add_const(c, car(call)->name);
+            int primitive = add_const(c, caddr(exp));
+            int to_end = -1;
+            if (value != unbound_obj) {
+                emit_op(c, OP_FOLDED, symbol);
+                emit(c, primitive);
+                emit(c, add_const(c, value));
+                to_end = c->num_instrs;
+                emit(c, -1);
+            }
+            if (op >= 0) {
+                for (Object* args = cdr(call); args != empty_list; args = cdr(args))
+                    compile(interp, c, car(args), false);
+                emit_op(c, tail ? OP_TAIL_INLINE : OP_INLINE, symbol);
+                emit(c, primitive);
+                emit(c, op);
+            } else {
+                compile_call(interp, c, call, tail);
+            }
+            if (to_end >= 0)
+                patch_jump(c, to_end);
+            break;
+        }
+
+        default:
+            compile_call(interp, c, exp, tail);
+            break;
+    }
+
+    interp->gc.num_roots = roots;
+}
+
+/* VM */
+
+#define PUSH(x) (*interp->vm.sp++ = (x))
+#define POP() (*--interp->vm.sp)
+#define TOP() (interp->vm.sp[-1])
+
+void vm_init(Interp* interp) {
+    interp->vm.stack = malloc(VM_STACK_MAX * sizeof(Object*));
+    interp->vm.frames = malloc(VM_FRAMES_MAX * sizeof(CallFrame));
+    assert(interp->vm.stack != NULL && interp->vm.frames != NULL, "out of memory");
+    interp->vm.sp = interp->vm.stack;
+    interp->vm.num_frames = 0;
+}
+
+CallFrame* vm_push_frame(Interp* interp, Object* code, Object* env) {
+    if (interp->vm.num_frames == VM_FRAMES_MAX)
+        raise_error("stack overflow");
+    CallFrame* frame = &interp->vm.frames[interp->vm.num_frames++];
+    if (interp->vm.num_frames > interp->counters.max_depth)
+        interp->counters.max_depth = interp->vm.num_frames;
+    frame->code = code;
+    frame->pc = code->instrs;
+    frame->env = env;
+    frame->profile_depth = interp->profiler.depth;
+    return frame;
+}
+
+Object* new_compiled_procedure(Interp* interp, Object* code, Object* env) {
+    GC_PROTECT(code);
+    Object* proc = new_procedure(interp, cadr(code->lambda), cddr(code->lambda), env);
+    proc->code = code;
+    GC_UNPROTECT(1);
+    return proc;
+}
+
+// refills a call site cache from the global value of symbol, which must be
+// a procedure that can take argc arguments. A global holds at most one
+// procedure per epoch, so threads filling the same cache only ever move it
+// to a later epoch, and store the procedure before the epoch that makes it
+// valid.
+void fill_call_cache(Interp* interp, CallCache* cache, Object* symbol, int argc) {
+    Heap* heap = interp->heap;
+    size_t epoch = __atomic_load_n(&heap->global_epoch, __ATOMIC_ACQUIRE);
+    Object* proc = __atomic_load_n(&symbol->value, __ATOMIC_ACQUIRE);
+    if (proc == unbound_obj)
+        unbound_global(symbol);
+    if (type(proc) == TYPE_PRIMITIVE) {
+        if (!primitive_accepts(proc, argc))
+            wrong_primitive_arguments(argc);
+    } else {
+        assert(type(proc) == TYPE_PROCEDURE, "expected compound procedure");
+    }
+    pthread_mutex_lock(&heap->code_lock);
+    if (epoch > cache->epoch) {
+        __atomic_store_n(&cache->proc, proc, __ATOMIC_RELAXED);
+        __atomic_store_n(&cache->epoch, epoch, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&heap->code_lock);
+}
+
+// whether a call site cache still holds its global's procedure
+bool cache_valid(Interp* interp, CallCache* cache) {
+    return __atomic_load_n(&cache->epoch, __ATOMIC_ACQUIRE) ==
+           __atomic_load_n(&interp->heap->global_epoch, __ATOMIC_RELAXED);
+}
+
+void jit_compile(Interp* interp, Object* code);
+int32_t* run_native(Interp* interp, CallFrame* frame, int32_t* pc);
+
+// starts a call of compound procedure proc on the argc arguments on top of
+// the stack, dropping drop slots, in a new frame or for a tail call in place
+// of frame, and returns the frame
+CallFrame* vm_enter(Interp* interp, CallFrame* frame, Object* proc, int argc, int drop, bool tail) {
+    GC_PROTECT(proc);
+    if (proc->code == NULL || type(proc->code) != TYPE_CODE) {
+        // procedures made by the analyzing evaluator are compiled on
+        // their first call
+        Object* lambda = make_lambda(interp, proc->params, proc->body);
+        Object* compiled = compile_lambda(interp, lambda);
+        proc->code = compiled;
+    }
+
+    interp->counters.calls++;
+    Object* new_env = new_frame(interp, proc->params, proc->frame_size, proc->env);
+    for (int i = 0; i < argc && i < proc->frame_size; i++)
+        new_env->slots[i] = interp->vm.sp[i - argc];
+    interp->vm.sp -= drop;
+
+    Object* code = proc->code;
+    if (tail) {
+        frame->code = code;
+        frame->pc = code->instrs;
+        frame->env = new_env;
+    } else {
+        frame = vm_push_frame(interp, code, new_env);
+    }
+    if (interp->profiler.enabled) {
+        profile_unwind(interp, frame->profile_depth);
+        profile_enter(interp, proc);
+    }
+    GC_UNPROTECT(1);
+
+    if (interp->vm.sp + code->num_instrs >= interp->vm.stack + VM_STACK_MAX)
+        raise_error("stack overflow");
+
+    // counted atomically, so one thread reaches the threshold
+    if (interp->jit && __atomic_load_n(&code->native, __ATOMIC_RELAXED) == NULL &&
+        __atomic_load_n(&code->deopts, __ATOMIC_RELAXED) < JIT_MAX_DEOPTS &&
+        __atomic_add_fetch(&code->entries, 1, __ATOMIC_RELAXED) == JIT_THRESHOLD)
+        jit_compile(interp, code);
+    return frame;
+}
+
+Object* vm_run(Interp* interp, Object* code, Object* env) {
+    size_t base = interp->vm.num_frames;
+    size_t outer_base = interp->vm.base;
+    interp->vm.base = base;
+    CallFrame* frame = vm_push_frame(interp, code, env);
+    int32_t* instrs = code->instrs;
+    Object** consts = code->consts;
+    int32_t* pc = instrs;
+    Object* proc;
+    int argc;
+    int drop;
+    bool tail;
+
+    if (interp->vm.sp + code->num_instrs >= interp->vm.stack + VM_STACK_MAX)
+        raise_error("stack overflow");
+
+    for (;;) {
+        interp->counters.evals++;
+        switch ((Opcode)*pc++) {
+            case OP_CONST:
+                PUSH(consts[*pc++]);
+                break;
+
+            case OP_LOOKUP:
+                PUSH(lookup_variable(interp, consts[*pc++], frame->env));
+                break;
+
+            case OP_LOCAL: {
+                Object* value = *local_slot(frame->env, pc[0], pc[1]);
+                if (value == unbound_obj)
+                    unbound_local(frame->env, pc[0], pc[1]);
+                pc += 2;
+                PUSH(value);
+                break;
+            }
+
+            case OP_GLOBAL: {
+                Object* symbol = consts[*pc++];
+                Object* value = __atomic_load_n(&symbol->value, __ATOMIC_ACQUIRE);
+                if (value == unbound_obj)
+                    unbound_global(symbol);
+                PUSH(value);
+                break;
+            }
+
+            case OP_SET_LOCAL:
+            case OP_DEFINE_LOCAL: {
+                Object** slot = local_slot(frame->env, pc[0], pc[1]);
+                if (pc[-1] == OP_SET_LOCAL && *slot == unbound_obj)
+                    unbound_local(frame->env, pc[0], pc[1]);
+                if (pc[-1] == OP_DEFINE_LOCAL)
+                    name_procedure(TOP(), slot_name(frame->env, pc[0], pc[1]));
+                pc += 2;
+                *slot = TOP();
+                TOP() = interp->ok_symbol;
+                break;
+            }
+
+            case OP_SET_GLOBAL:
+            case OP_DEFINE_GLOBAL: {
+                Object* symbol = consts[*pc];
+                if (pc[-1] == OP_SET_GLOBAL && symbol->value == unbound_obj)
+                    unbound_global(symbol);
+                if (pc[-1] == OP_DEFINE_GLOBAL)
+                    name_procedure(TOP(), symbol);
+                pc++;
+                set_global(interp, symbol, TOP());
+                TOP() = interp->ok_symbol;
+                break;
+            }
+
+            case OP_SET_NAME:
+                set_variable_value(interp, consts[*pc++], TOP(), frame->env);
+                TOP() = interp->ok_symbol;
+                break;
+
+            case OP_DEFINE_NAME:
+                name_procedure(TOP(), consts[*pc]);
+                define_variable(interp, consts[*pc++], TOP(), frame->env);
+                TOP() = interp->ok_symbol;
+                break;
+
+            case OP_POP:
+                interp->vm.sp--;
+                break;
+
+            case OP_JUMP:
+                pc = instrs + *pc;
+                break;
+
+            case OP_JUMP_IF_FALSE:
+                pc = POP() == false_obj ? instrs + *pc : pc + 1;
+                break;
+
+            case OP_JUMP_UNLESS_TRUE:
+                pc = POP() != true_obj ? instrs + *pc : pc + 1;
+                break;
+
+            case OP_CLOSURE: {
+                Object* proc = new_compiled_procedure(interp, consts[*pc++], frame->env);
+                PUSH(proc);
+                break;
+            }
+
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                tail = pc[-1] == OP_TAIL_CALL;
+                argc = *pc++;
+                proc = interp->vm.sp[-argc - 1];
+                drop = argc + 1;
+                goto call;
+
+            case OP_CALL_GLOBAL:
+            case OP_TAIL_CALL_GLOBAL: {
+                // the procedure is not on the stack, and another thread may
+                // change the global, so vm_enter roots it
+                CallCache* cache = &code->caches[pc[2]];
+                tail = pc[-1] == OP_TAIL_CALL_GLOBAL;
+                argc = pc[1];
+                if (!cache_valid(interp, cache))
+                    fill_call_cache(interp, cache, consts[pc[0]], argc);
+                pc += 3;
+                proc = __atomic_load_n(&cache->proc, __ATOMIC_RELAXED);
+                drop = argc;
+                frame->pc = pc;
+                if (proc->type == TYPE_PROCEDURE)
+                    goto enter;
+
+                Object* result = invoke_primitive(interp, proc, argc, interp->vm.sp - argc);
+                interp->vm.sp -= argc;
+                PUSH(result);
+                break;
+            }
+
+            case OP_INLINE:
+            case OP_TAIL_INLINE: {
+                Object* symbol = consts[pc[0]];
+                InlineOp op = pc[2];
+                argc = inline_ops[op].argc;
+                pc += 3;
+                proc = __atomic_load_n(&symbol->value, __ATOMIC_ACQUIRE);
+                if (proc != consts[pc[-2]]) {
+                    // the global has changed since this was compiled
+                    if (proc == unbound_obj)
+                        unbound_global(symbol);
+                    drop = argc;
+                    tail = pc[-4] == OP_TAIL_INLINE;
+                    goto call;
+                }
+
+                Object* result = run_inline(interp, op, interp->vm.sp - argc);
+                interp->vm.sp -= argc;
+                PUSH(result);
+                break;
+            }
+
+            case OP_FOLDED:
+                if (consts[pc[0]]->value == consts[pc[1]]) {
+                    PUSH(consts[pc[2]]);
+                    pc = instrs + pc[3];
+                } else {
+                    pc += 4;
+                }
+                break;
+
+            case OP_APPLY:
+            case OP_TAIL_APPLY: {
+                tail = pc[-1] == OP_TAIL_APPLY;
+                interp->counters.argument_lists++;
+                Object* list = POP();
+                for (argc = 0; list != empty_list; argc++) {
+                    PUSH(car(list));
+                    list = cdr(list);
+                }
+                proc = interp->vm.sp[-argc - 1];
+                drop = argc + 1;
+                goto call;
+            }
+
+            case OP_RETURN: {
+                Object* result = POP();
+                if (interp->profiler.enabled)
+                    profile_unwind(interp, frame->profile_depth);
+                interp->vm.num_frames--;
+                if (interp->vm.num_frames == base) {
+                    interp->vm.base = outer_base;
+                    return result;
+                }
+
+                frame = &interp->vm.frames[interp->vm.num_frames - 1];
+                code = frame->code;
+                instrs = code->instrs;
+                consts = code->consts;
+                pc = frame->pc;
+                PUSH(result);
+                if (__atomic_load_n(&code->native, __ATOMIC_RELAXED) != NULL)
+                    goto native;
+                break;
+            }
+        }
+        continue;
+
+    call:
+        // proc is drop - argc slots below the arguments, which keeps it rooted
+        frame->pc = pc;
+        if (type(proc) == TYPE_PRIMITIVE) {
+            // the arguments are passed in place on the VM stack
+            Object* result = call_primitive(interp, proc, argc, interp->vm.sp - argc);
+
+            interp->vm.sp -= drop;
+            PUSH(result);
+            if (__atomic_load_n(&code->native, __ATOMIC_RELAXED) != NULL)
+                goto native;
+            continue;
+        }
+        assert(type(proc) == TYPE_PROCEDURE, "expected compound procedure");
+
+    enter:
+        frame = vm_enter(interp, frame, proc, argc, drop, tail);
+        code = frame->code;
+        instrs = code->instrs;
+        consts = code->consts;
+        pc = instrs;
+        if (__atomic_load_n(&code->native, __ATOMIC_RELAXED) == NULL)
+            continue;
+
+    native:
+        // native code runs until an instruction it leaves to the VM, in
+        // whichever frame it has got to
+        pc = run_native(interp, frame, pc);
+        frame = &interp->vm.frames[interp->vm.num_frames - 1];
+        code = frame->code;
+        instrs = code->instrs;
+        consts = code->consts;
+        if (pc == NULL)
+            pc = frame->pc;
+    }
+}
+
+Object* vm_eval(Interp* interp, Object* exp, Object* env) {
+    Object* code = compile_toplevel(interp, exp);
+    GC_PROTECT(code);
+    Object* result = vm_run(interp, code, env);
+    GC_UNPROTECT(1);
+    return result;
+}
+
+// evaluates a resolved top-level form on the interpreter's engine
+Object* eval_toplevel(Interp* interp, Object* exp) {
+    if (interp->optimize)
+        exp = optimize(interp, exp);
+    GC_PROTECT(exp);
+    Object* result = interp->engine == ENGINE_VM ? vm_eval(interp, exp, interp->global_env)
+                                                 : eval(interp, exp, interp->global_env);
+    GC_UNPROTECT(1);
+    return result;
+}
+
+/* JIT */
+
+// Code entered JIT_THRESHOLD times is translated into x86-64 code, one
+// template per instruction working on the VM's own stack and frames, so the
+// VM can hand a frame over at any instruction and take it back. While native
+// code runs, rbx holds the interpreter, r12 the stack pointer, r13 the
+// frame's environment and r15 the CallFrame. Calls to compound procedures,
+// returns and the rarer instructions are left to the VM, which re-enters the
+// native code when the frame carries on. Inline operations do fixnum and
+// pair work in place behind the optimizer's guard; a failed guard discards
+// the translation, and the next one leaves that operation to the VM. Code
+// discarded JIT_MAX_DEOPTS times is not translated again.
+
+void free_native(NativeCode* native) {
+    munmap(native->memory, native->size);
+    free(native->offsets);
+    free(native);
+}
+
+// frees the native code dropped by deopts, once no native run is left that
+// could be in it: when a thread alone in the heap leaves its outermost run,
+// or at a collection that finds no thread in native code
+void free_discarded(Heap* heap) {
+    while (heap->discarded != NULL) {
+        NativeCode* next = heap->discarded->next;
+        free_native(heap->discarded);
+        heap->discarded = next;
+    }
+}
+
+// the code's translation may be dropped by another thread at any time, so
+// it is read once
+NativeJump native_jump(CallFrame* frame) {
+    NativeCode* native = __atomic_load_n(&frame->code->native, __ATOMIC_ACQUIRE);
+    if (native == NULL)
+        return (NativeJump){NULL, frame};
+    return (NativeJump){native->memory + native->offsets[frame->pc - frame->code->instrs], frame};
+}
+
+// a call instruction at pc from native code: primitives are called in
+// place, compound procedures entered as the VM would
+NativeJump jit_call(Interp* interp, CallFrame* frame, int32_t* pc) {
+    Opcode op = pc[0];
+    bool global = op == OP_CALL_GLOBAL || op == OP_TAIL_CALL_GLOBAL;
+    Object* proc;
+    int argc;
+    int drop;
+    if (global) {
+        CallCache* cache = &frame->code->caches[pc[3]];
+        argc = pc[2];
+        if (!cache_valid(interp, cache))
+            fill_call_cache(interp, cache, frame->code->consts[pc[1]], argc);
+        proc = __atomic_load_n(&cache->proc, __ATOMIC_RELAXED);
+        drop = argc;
+        frame->pc = pc + 4;
+    } else {
+        argc = pc[1];
+        proc = interp->vm.sp[-argc - 1];
+        drop = argc + 1;
+        frame->pc = pc + 2;
+    }
+
+    if (type(proc) == TYPE_PRIMITIVE) {
+        Object* result = global ? invoke_primitive(interp, proc, argc, interp->vm.sp - argc)
+                                : call_primitive(interp, proc, argc, interp->vm.sp - argc);
+        interp->vm.sp -= drop;
+        PUSH(result);
+        return native_jump(frame);
+    }
+    assert(type(proc) == TYPE_PROCEDURE, "expected compound procedure");
+    bool tail = op == OP_TAIL_CALL || op == OP_TAIL_CALL_GLOBAL;
+    return native_jump(vm_enter(interp, frame, proc, argc, drop, tail));
+}
+
+// OP_RETURN at pc from native code; the VM returns from vm_run itself
+NativeJump jit_return(Interp* interp, CallFrame* frame, int32_t* pc) {
+    if (interp->vm.num_frames - 1 == interp->vm.base) {
+        frame->pc = pc;
+        return (NativeJump){NULL, frame};
+    }
+
+    Object* result = POP();
+    if (interp->profiler.enabled)
+        profile_unwind(interp, frame->profile_depth);
+    interp->vm.num_frames--;
+    PUSH(result);
+    return native_jump(&interp->vm.frames[interp->vm.num_frames - 1]);
+}
+
+void jit_inline(Interp* interp, InlineOp op) {
+    int argc = inline_ops[op].argc;
+    Object* result = run_inline(interp, op, interp->vm.sp - argc);
+    interp->vm.sp -= argc;
+    PUSH(result);
+}
+
+void jit_set_local(Interp* interp, Object* env, int depth, int index, bool define) {
+    Object** slot = local_slot(env, depth, index);
+    if (!define && *slot == unbound_obj)
+        unbound_local(env, depth, index);
+    if (define)
+        name_procedure(TOP(), slot_name(env, depth, index));
+    *slot = TOP();
+    TOP() = interp->ok_symbol;
+}
+
+void jit_set_global(Interp* interp, Object* symbol, bool define) {
+    if (!define && symbol->value == unbound_obj)
+        unbound_global(symbol);
+    if (define)
+        name_procedure(TOP(), symbol);
+    set_global(interp, symbol, TOP());
+    TOP() = interp->ok_symbol;
+}
+
+#if defined(__x86_64__)
+
+#define ASM(a, s) asm_raw(a, s, sizeof(s) - 1)
+#define SP_OFFSET ((int32_t)(offsetof(Interp, vm) + offsetof(VMState, sp)))
+
+// condition codes for asm_jump
+#define CC_ALWAYS -1
+#define CC_E 0x4
+#define CC_NE 0x5
+
+void asm_raw(Assembler* a, const char* bytes, size_t n) {
+    if (a->size + n > a->capacity) {
+        a->capacity = a->capacity ? a->capacity * 2 : 4096;
+        a->bytes = realloc(a->bytes, a->capacity);
+        assert(a->bytes != NULL, "out of memory");
+    }
+    memcpy(a->bytes + a->size, bytes, n);
+    a->size += n;
+}
+
+void asm_byte(Assembler* a, uint8_t byte) {
+    asm_raw(a, (char*)&byte, 1);
+}
+
+void asm_u32(Assembler* a, uint32_t word) {
+    for (int i = 0; i < 4; i++)
+        asm_byte(a, word >> (8 * i));
+}
+
+void asm_u64(Assembler* a, uint64_t word) {
+    asm_u32(a, word);
+    asm_u32(a, word >> 32);
+}
+
+// a 64-bit operation between reg and [base + disp], e.g. 0x8b loads and
+// 0x89 stores
+void asm_mem(Assembler* a, uint8_t opcode, Reg reg, Reg base, int32_t disp) {
+    asm_byte(a, 0x48 | (reg >= R8 ? 4 : 0) | (base >= R8 ? 1 : 0));
+    asm_byte(a, opcode);
+    asm_byte(a, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP)
+        asm_byte(a, 0x24);
+    asm_u32(a, disp);
+}
+
+// a 64-bit operation from reg to rm, e.g. 0x89 moves and 0x39 compares
+void asm_regs(Assembler* a, uint8_t opcode, Reg reg, Reg rm) {
+    asm_byte(a, 0x48 | (reg >= R8 ? 4 : 0) | (rm >= R8 ? 1 : 0));
+    asm_byte(a, opcode);
+    asm_byte(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+void asm_mov_imm(Assembler* a, Reg reg, uint64_t value) {
+    asm_byte(a, 0x48 | (reg >= R8 ? 1 : 0));
+    asm_byte(a, 0xb8 + (reg & 7));
+    asm_u64(a, value);
+}
+
+void asm_mov_imm32(Assembler* a, Reg reg, uint32_t value) {
+    if (reg >= R8)
+        asm_byte(a, 0x41);
+    asm_byte(a, 0xb8 + (reg & 7));
+    asm_u32(a, value);
+}
+
+// add (0), sub (5) or cmp (7) of a sign-extended 32-bit value
+void asm_alu_imm(Assembler* a, int op, Reg reg, int32_t value) {
+    asm_byte(a, 0x48 | (reg >= R8 ? 1 : 0));
+    asm_byte(a, 0x81);
+    asm_byte(a, 0xc0 | op << 3 | (reg & 7));
+    asm_u32(a, value);
+}
+
+// emits a jump with a rel32 to fill in and returns where it is
+size_t asm_jump(Assembler* a, int cc) {
+    if (cc == CC_ALWAYS) {
+        asm_byte(a, 0xe9);
+    } else {
+        asm_byte(a, 0x0f);
+        asm_byte(a, 0x80 + cc);
+    }
+    asm_u32(a, 0);
+    return a->size - 4;
+}
+
+void asm_patch(Assembler* a, size_t at, size_t dest) {
+    int32_t rel = dest - (at + 4);
+    memcpy(a->bytes + at, &rel, 4);
+}
+
+void asm_fixup(Assembler* a, size_t at, int target, bool exit, bool deopt) {
+    if (a->num_fixups == a->fixups_capacity) {
+        a->fixups_capacity = a->fixups_capacity ? a->fixups_capacity * 2 : 16;
+        a->fixups = realloc(a->fixups, a->fixups_capacity * sizeof(JitFixup));
+        assert(a->fixups != NULL, "out of memory");
+    }
+    a->fixups[a->num_fixups++] = (JitFixup){at, target, exit, deopt};
+}
+
+// jumps to the code of instruction target
+void asm_goto(Assembler* a, int cc, int target) {
+    asm_fixup(a, asm_jump(a, cc), target, false, false);
+}
+
+// leaves to the VM at instruction target
+void asm_exit(Assembler* a, int cc, int target, bool deopt) {
+    asm_fixup(a, asm_jump(a, cc), target, true, deopt);
+}
+
+void asm_push_rax(Assembler* a) {
+    asm_mem(a, 0x89, RAX, R12, 0);
+    asm_alu_imm(a, 0, R12, sizeof(Object*));
+}
+
+void asm_pop_rax(Assembler* a) {
+    asm_alu_imm(a, 5, R12, sizeof(Object*));
+    asm_mem(a, 0x8b, RAX, R12, 0);
+}
+
+// calls a C function once the caller has put its arguments after rdi in
+// place, with interp->vm.sp in step with r12 across it
+void asm_call(Assembler* a, void (*func)(void)) {
+    asm_regs(a, 0x89, RBX, RDI);
+    asm_mem(a, 0x89, R12, RBX, SP_OFFSET);
+    asm_mov_imm(a, RAX, (uintptr_t)func);
+    ASM(a, "\xff\xd0");                             // call rax
+    asm_mem(a, 0x8b, R12, RBX, SP_OFFSET);
+}
+
+// goes on where the NativeJump returned in rax:rdx says, switching to its
+// frame, or returns to the VM with NULL
+void asm_jump_native(Assembler* a, size_t epilogue) {
+    ASM(a, "\x48\x85\xc0");                           // test rax, rax
+    asm_patch(a, asm_jump(a, CC_E), epilogue);
+    asm_regs(a, 0x89, RDX, R15);
+    asm_mem(a, 0x8b, R13, R15, offsetof(CallFrame, env));
+    ASM(a, "\xff\xe0");                               // jmp rax
+}
+
+// rax = the slot of a local, rcx its address
+void asm_local(Assembler* a, int depth, int index) {
+    asm_regs(a, 0x89, R13, RCX);
+    while (depth-- > 0)
+        asm_mem(a, 0x8b, RCX, RCX, offsetof(Object, parent));
+    asm_alu_imm(a, 0, RCX, offsetof(Object, slots) + index * sizeof(Object*));
+    asm_mem(a, 0x8b, RAX, RCX, 0);
+}
+
+// jumps to the code after the guard's instruction, or out of the native
+// code, unless symbol still holds primitive
+void asm_guard(Assembler* a, Object* symbol, Object* primitive, int exit_at, bool deopt) {
+    asm_mov_imm(a, RAX, (uintptr_t)symbol);
+    asm_mem(a, 0x8b, RAX, RAX, offsetof(Object, value));
+    asm_mov_imm(a, RCX, (uintptr_t)primitive);
+    asm_regs(a, 0x39, RCX, RAX);
+    if (deopt)
+        asm_exit(a, CC_NE, exit_at, true);
+    else
+        asm_goto(a, CC_NE, exit_at);
+}
+
+// a guarded inline operation on the arguments on top of the stack; the slow
+// path is the same operation in C
+void asm_inline(Assembler* a, InlineOp op) {
+    size_t slow = 0, done;
+    switch (op) {
+        case INLINE_ADD:
+        case INLINE_SUB:
+        case INLINE_MUL:
+        case INLINE_EQUALS:
+        case INLINE_LESS_THAN:
+            asm_mem(a, 0x8b, RAX, R12, -16);
+            asm_mem(a, 0x8b, RCX, R12, -8);
+            ASM(a, "\x89\xc2\x21\xca\xf6\xc2\x01");     // mov edx, eax; and edx, ecx; test dl, 1
+            slow = asm_jump(a, CC_E);
+            if (op == INLINE_EQUALS) {
+                ASM(a, "\x48\x39\xc8\x0f\x94\xc2");     // cmp rax, rcx; sete dl
+            } else {
+                ASM(a, "\x48\xd1\xf8\x48\xd1\xf9");     // sar rax, 1; sar rcx, 1
+                if (op == INLINE_ADD)
+                    ASM(a, "\x01\xc8");                 // add eax, ecx
+                else if (op == INLINE_SUB)
+                    ASM(a, "\x29\xc8");                 // sub eax, ecx
+                else if (op == INLINE_MUL)
+                    ASM(a, "\x0f\xaf\xc1");             // imul eax, ecx
+                else
+                    ASM(a, "\x39\xc1\x0f\x9c\xc2");     // cmp ecx, eax; setl dl
+            }
+            if (op == INLINE_EQUALS || op == INLINE_LESS_THAN)
+                ASM(a, "\x0f\xb6\xd2\x48\x8d\x04\xd5\x02\x00\x00\x00");  // movzx edx, dl; lea rax, [rdx*8+2]
+            else
+                ASM(a, "\x48\x63\xc0\x48\x8d\x04\x45\x01\x00\x00\x00");  // movsxd rax, eax; lea rax, [rax*2+1]
+            asm_alu_imm(a, 5, R12, sizeof(Object*));
+            asm_mem(a, 0x89, RAX, R12, -8);
+            break;
+
+        case INLINE_IS_NULL:
+            asm_mem(a, 0x8b, RAX, R12, -8);
+            asm_alu_imm(a, 7, RAX, (intptr_t)empty_list);
+            ASM(a, "\x0f\x94\xc2\x0f\xb6\xd2\x48\x8d\x04\xd5\x02\x00\x00\x00");  // sete dl; movzx; lea
+            asm_mem(a, 0x89, RAX, R12, -8);
+            return;
+
+        case INLINE_IS_PAIR: {
+            asm_mem(a, 0x8b, RAX, R12, -8);
+            ASM(a, "\x31\xd2\xa8\x07");                 // xor edx, edx; test al, 7
+            size_t immediate = asm_jump(a, CC_NE);
+            ASM(a, "\x83\x38");                         // cmp dword [rax], TYPE_PAIR
+            asm_byte(a, TYPE_PAIR);
+            ASM(a, "\x0f\x94\xc2");                     // sete dl
+            asm_patch(a, immediate, a->size);
+            ASM(a, "\x48\x8d\x04\xd5\x02\x00\x00\x00"); // lea rax, [rdx*8+2]
+            asm_mem(a, 0x89, RAX, R12, -8);
+            return;
+        }
+
+        case INLINE_CAR:
+        case INLINE_CDR: {
+            asm_mem(a, 0x8b, RAX, R12, -8);
+            ASM(a, "\xa8\x07");                         // test al, 7
+            slow = asm_jump(a, CC_NE);
+            ASM(a, "\x83\x38");                         // cmp dword [rax], TYPE_PAIR
+            asm_byte(a, TYPE_PAIR);
+            size_t other = asm_jump(a, CC_NE);
+            asm_mem(a, 0x8b, RAX, RAX, op == INLINE_CAR ? offsetof(Object, car) : offsetof(Object, cdr));
+            asm_mem(a, 0x89, RAX, R12, -8);
+            done = asm_jump(a, CC_ALWAYS);
+            asm_patch(a, slow, a->size);
+            asm_patch(a, other, a->size);
+            asm_mov_imm32(a, RSI, op);
+            asm_call(a, (void (*)(void))jit_inline);
+            asm_patch(a, done, a->size);
+            return;
+        }
+
+        default:
+            asm_mov_imm32(a, RSI, op);
+            asm_call(a, (void (*)(void))jit_inline);
+            return;
+    }
+
+    done = asm_jump(a, CC_ALWAYS);
+    asm_patch(a, slow, a->size);
+    asm_mov_imm32(a, RSI, op);
+    asm_call(a, (void (*)(void))jit_inline);
+    asm_patch(a, done, a->size);
+}
+
+// translates code into native code, or leaves it to the VM if that fails
+void jit_compile(Interp* interp, Object* code) {
+    Assembler a = {0};
+    a.offsets = calloc(code->num_instrs, sizeof(uint32_t));
+    assert(a.offsets != NULL || code->num_instrs == 0, "out of memory");
+    int32_t* instrs = code->instrs;
+    Object** consts = code->consts;
+
+    // entry(interp, frame, address): save the registers the C calling
+    // convention preserves, which also keeps rsp 16-byte aligned for calls
+    ASM(&a, "\x55\x53\x41\x54\x41\x55\x41\x57");      // push rbp, rbx, r12, r13, r15
+    asm_regs(&a, 0x89, RDI, RBX);
+    asm_regs(&a, 0x89, RSI, R15);
+    asm_mem(&a, 0x8b, R12, RBX, SP_OFFSET);
+    asm_mem(&a, 0x8b, R13, R15, offsetof(CallFrame, env));
+    ASM(&a, "\xff\xe2");                                // jmp rdx
+    size_t epilogue = a.size;
+    ASM(&a, "\x41\x5f\x41\x5d\x41\x5c\x5b\x5d\xc3");  // pop r15, r13, r12, rbx, rbp; ret
+
+    int i = 0;
+    while (i < code->num_instrs) {
+        int32_t* pc = instrs + i + 1;
+        a.offsets[i] = a.size;
+        Opcode op = instrs[i];
+        switch (op) {
+            case OP_CONST:
+                asm_mov_imm(&a, RAX, (uintptr_t)consts[pc[0]]);
+                asm_push_rax(&a);
+                i += 2;
+                break;
+
+            case OP_LOCAL:
+                asm_local(&a, pc[0], pc[1]);
+                asm_alu_imm(&a, 7, RAX, (intptr_t)unbound_obj);
+                asm_exit(&a, CC_E, i, false);
+                asm_push_rax(&a);
+                i += 3;
+                break;
+
+            case OP_GLOBAL:
+                asm_mov_imm(&a, RAX, (uintptr_t)consts[pc[0]]);
+                asm_mem(&a, 0x8b, RAX, RAX, offsetof(Object, value));
+                asm_alu_imm(&a, 7, RAX, (intptr_t)unbound_obj);
+                asm_exit(&a, CC_E, i, false);
+                asm_push_rax(&a);
+                i += 2;
+                break;
+
+            case OP_SET_LOCAL:
+            case OP_DEFINE_LOCAL:
+                asm_regs(&a, 0x89, R13, RSI);
+                asm_mov_imm32(&a, RDX, pc[0]);
+                asm_mov_imm32(&a, RCX, pc[1]);
+                asm_mov_imm32(&a, R8, op == OP_DEFINE_LOCAL);
+                asm_call(&a, (void (*)(void))jit_set_local);
+                i += 3;
+                break;
+
+            case OP_SET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+                asm_mov_imm(&a, RSI, (uintptr_t)consts[pc[0]]);
+                asm_mov_imm32(&a, RDX, op == OP_DEFINE_GLOBAL);
+                asm_call(&a, (void (*)(void))jit_set_global);
+                i += 2;
+                break;
+
+            case OP_POP:
+                asm_alu_imm(&a, 5, R12, sizeof(Object*));
+                i += 1;
+                break;
+
+            case OP_JUMP:
+                asm_goto(&a, CC_ALWAYS, pc[0]);
+                i += 2;
+                break;
+
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_UNLESS_TRUE:
+                asm_pop_rax(&a);
+                if (op == OP_JUMP_IF_FALSE) {
+                    asm_alu_imm(&a, 7, RAX, (intptr_t)false_obj);
+                    asm_goto(&a, CC_E, pc[0]);
+                } else {
+                    asm_alu_imm(&a, 7, RAX, (intptr_t)true_obj);
+                    asm_goto(&a, CC_NE, pc[0]);
+                }
+                i += 2;
+                break;
+
+            case OP_CLOSURE:
+                asm_mov_imm(&a, RSI, (uintptr_t)consts[pc[0]]);
+                asm_regs(&a, 0x89, R13, RDX);
+                asm_call(&a, (void (*)(void))new_compiled_procedure);
+                asm_push_rax(&a);
+                i += 2;
+                break;
+
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_CALL_GLOBAL:
+            case OP_TAIL_CALL_GLOBAL:
+            case OP_RETURN:
+                asm_regs(&a, 0x89, R15, RSI);
+                asm_mov_imm(&a, RDX, (uintptr_t)(instrs + i));
+                asm_call(&a, op == OP_RETURN ? (void (*)(void))jit_return : (void (*)(void))jit_call);
+                asm_jump_native(&a, epilogue);
+                i += op == OP_RETURN ? 1 : op == OP_CALL || op == OP_TAIL_CALL ? 2 : 4;
+                break;
+
+            case OP_INLINE:
+            case OP_TAIL_INLINE:
+                // a guard that fails already is left to the VM, or the code
+                // would be discarded again on its first run
+                if (consts[pc[0]]->value != consts[pc[1]]) {
+                    asm_exit(&a, CC_ALWAYS, i, false);
+                } else {
+                    asm_guard(&a, consts[pc[0]], consts[pc[1]], i, true);
+                    asm_inline(&a, pc[2]);
+                }
+                i += 4;
+                break;
+
+            case OP_FOLDED:
+                asm_guard(&a, consts[pc[0]], consts[pc[1]], i + 5, false);
+                asm_mov_imm(&a, RAX, (uintptr_t)consts[pc[2]]);
+                asm_push_rax(&a);
+                asm_goto(&a, CC_ALWAYS, pc[3]);
+                i += 5;
+                break;
+
+            default:
+                // apply and lookups by name are run by the VM
+                asm_exit(&a, CC_ALWAYS, i, false);
+                i += op == OP_LOOKUP || op == OP_SET_NAME || op == OP_DEFINE_NAME ? 2 : 1;
+                break;
+        }
+    }
+
+    for (int f = 0; f < a.num_fixups; f++) {
+        JitFixup* fixup = &a.fixups[f];
+        if (!fixup->exit) {
+            asm_patch(&a, fixup->at, a.offsets[fixup->target]);
+            continue;
+        }
+        asm_patch(&a, fixup->at, a.size);
+        asm_mem(&a, 0x89, R12, RBX, SP_OFFSET);
+        asm_mov_imm(&a, RAX, (uintptr_t)(instrs + fixup->target) | (fixup->deopt ? JIT_DEOPT : 0));
+        asm_patch(&a, asm_jump(&a, CC_ALWAYS), epilogue);
+    }
+    free(a.fixups);
+
+    uint8_t* memory = mmap(NULL, a.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        free(a.bytes);
+        free(a.offsets);
+        return;
+    }
+    memcpy(memory, a.bytes, a.size);
+    free(a.bytes);
+    if (mprotect(memory, a.size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, a.size);
+        free(a.offsets);
+        return;
+    }
+
+    NativeCode* native = calloc(1, sizeof(NativeCode));
+    assert(native != NULL, "out of memory");
+    native->memory = memory;
+    native->size = a.size;
+    native->offsets = a.offsets;
+
+    // another thread may have translated the code meanwhile
+    Heap* heap = interp->heap;
+    pthread_mutex_lock(&heap->code_lock);
+    bool installed = code->native == NULL;
+    if (installed)
+        __atomic_store_n(&code->native, native, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&heap->code_lock);
+    if (!installed) {
+        free_native(native);
+        return;
+    }
+    interp->counters.native_compiles++;
+}
+
+#else
+
+void jit_compile(Interp* interp, Object* code) {
+    (void)interp;
+    (void)code;
+}
+
+#endif
+
+// runs the frame's native code from pc, and returns the instruction the VM
+// is to carry on from in the top frame
+int32_t* run_native(Interp* interp, CallFrame* frame, int32_t* pc) {
+    Heap* heap = interp->heap;
+    NativeCode* native = __atomic_load_n(&frame->code->native, __ATOMIC_ACQUIRE);
+    if (native == NULL)
+        return pc;
+    NativeEntry entry = (NativeEntry)(void*)native->memory;
+    interp->vm.native_depth++;
+    int32_t* next = entry(interp, frame, native->memory + native->offsets[pc - frame->code->instrs]);
+    interp->vm.native_depth--;
+
+    if ((uintptr_t)next & JIT_DEOPT) {
+        // a native run outside this one, or on another thread, may still be
+        // in the discarded code
+        Object* code = interp->vm.frames[interp->vm.num_frames - 1].code;
+        next = (int32_t*)((uintptr_t)next & ~(uintptr_t)JIT_DEOPT);
+        pthread_mutex_lock(&heap->code_lock);
+        if (code->native != NULL) {
+            code->native->next = heap->discarded;
+            heap->discarded = code->native;
+            __atomic_store_n(&code->native, NULL, __ATOMIC_RELAXED);
+            __atomic_store_n(&code->entries, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&code->deopts, code->deopts + 1, __ATOMIC_RELAXED);
+            interp->counters.deopts++;
+        }
+        pthread_mutex_unlock(&heap->code_lock);
+    }
+    if (interp->vm.native_depth == 0 && heap->num_threads == 1)
+        free_discarded(heap);
+    return next;
+}
+
+/* Image */
+
+// A heap image is everything reachable from the symbol table, written as
+// one record per object with pointers replaced by record numbers, so it can
+// be rebuilt at any address. A record is a word holding the type and form,
+// then the object's fields as 64-bit words; strings and symbol names are
+// stored inline, padded to a word. Primitives are stored as their index in
+// the primitive table. Analyzed procedure bodies hold C function pointers,
+// so they are left out and analyzed again on first use.
+
+// fields of the interpreter holding objects that init creates
+const size_t image_builtins[] = {
+    offsetof(Interp, global_env),
+    offsetof(Interp, or_temp_symbol),
+    offsetof(Interp, inline_symbol),
+};
+
+#define NUM_IMAGE_BUILTINS (sizeof(image_builtins) / sizeof(image_builtins[0]))
+#define image_builtin_object(interp, k) (*(Object**)((char*)(interp) + image_builtins[k]))
+
+void image_emit(ImageWriter* w, uint64_t word) {
+    if (w->num_words == w->words_capacity) {
+        w->words_capacity = w->words_capacity ? w->words_capacity * 2 : 4096;
+        w->words = realloc(w->words, w->words_capacity * sizeof(uint64_t));
+        assert(w->words != NULL, "out of memory");
+    }
+    w->words[w->num_words++] = word;
+}
+
+void image_emit_bytes(ImageWriter* w, const char* bytes, size_t len) {
+    image_emit(w, len);
+    for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        size_t n = len - i < sizeof(uint64_t) ? len - i : sizeof(uint64_t);
+        memcpy(&word, bytes + i, n);
+        image_emit(w, word);
+    }
+}
+
+size_t image_slot(ImageWriter* w, Object* obj) {
+    size_t mask = w->index_capacity - 1;
+    size_t slot = ((uintptr_t)obj >> 3) * 0x9e3779b97f4a7c15ull & mask;
+    while (w->index_keys[slot] != NULL && w->index_keys[slot] != obj)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+void image_grow_index(ImageWriter* w) {
+    Object** keys = w->index_keys;
+    size_t* values = w->index_values;
+    size_t capacity = w->index_capacity;
+
+    w->index_capacity = capacity ? capacity * 2 : 4096;
+    w->index_keys = calloc(w->index_capacity, sizeof(Object*));
+    w->index_values = malloc(w->index_capacity * sizeof(size_t));
+    assert(w->index_keys != NULL && w->index_values != NULL, "out of memory");
+
+    for (size_t i = 0; i < capacity; i++) {
+        if (keys[i] != NULL) {
+            size_t slot = image_slot(w, keys[i]);
+            w->index_keys[slot] = keys[i];
+            w->index_values[slot] = values[i];
+        }
+    }
+    free(keys);
+    free(values);
+}
+
+int image_builtin(Interp* interp, Object* obj) {
+    for (size_t i = 0; i < NUM_IMAGE_BUILTINS; i++) {
+        if (image_builtin_object(interp, i) == obj)
+            return i;
+    }
+    return -1;
+}
+
+// numbers an object the first time it is reached
+void image_reach(Interp* interp, ImageWriter* w, Object* obj) {
+    if (obj == NULL || is_immediate(obj) || image_builtin(interp, obj) >= 0)
+        return;
+    if ((w->num_objects + 1) * 2 > w->index_capacity)
+        image_grow_index(w);
+
+    size_t slot = image_slot(w, obj);
+    if (w->index_keys[slot] != NULL)
+        return;
+    w->index_keys[slot] = obj;
+    w->index_values[slot] = w->num_objects;
+
+    if (w->num_objects == w->objects_capacity) {
+        w->objects_capacity = w->objects_capacity ? w->objects_capacity * 2 : 4096;
+        w->objects = realloc(w->objects, w->objects_capacity * sizeof(Object*));
+        assert(w->objects != NULL, "out of memory");
+    }
+    w->objects[w->num_objects++] = obj;
+}
+
+uint64_t image_ref(Interp* interp, ImageWriter* w, Object* obj) {
+    if (obj == NULL || is_immediate(obj))
+        return (uintptr_t)obj;
+    int builtin = image_builtin(interp, obj);
+    if (builtin >= 0)
+        return ((uint64_t)builtin << 3) | IMAGE_TAG_BUILTIN;
+    return (w->index_values[image_slot(w, obj)] + 1) << 3;
+}
+
+// the code field of a procedure, unless it is an analyzed body
+Object* image_code(Object* proc) {
+    if (proc->code == NULL || type(proc->code) != TYPE_CODE)
+        return NULL;
+    return proc->code;
+}
+
+void image_reach_fields(Interp* interp, ImageWriter* w, Object* obj) {
+    switch (obj->type) {
+        case TYPE_SYMBOL:
+            if (w->symbol_values)
+                image_reach(interp, w, obj->value);
+            break;
+        case TYPE_PAIR:
+            image_reach(interp, w, obj->car);
+            image_reach(interp, w, obj->cdr);
+            break;
+        case TYPE_PROCEDURE:
+            image_reach(interp, w, obj->params);
+            image_reach(interp, w, obj->body);
+            image_reach(interp, w, obj->env);
+            image_reach(interp, w, image_code(obj));
+            image_reach(interp, w, obj->proc_name);
+            break;
+        case TYPE_LOCALREF:
+        case TYPE_GLOBALREF:
+            image_reach(interp, w, obj->name);
+            break;
+        case TYPE_FRAME:
+            image_reach(interp, w, obj->parent);
+            image_reach(interp, w, obj->vars);
+            image_reach(interp, w, obj->overflow);
+            for (int i = 0; i < obj->num_slots; i++)
+                image_reach(interp, w, obj->slots[i]);
+            break;
+        case TYPE_CODE:
+            image_reach(interp, w, obj->lambda);
+            for (int i = 0; i < obj->num_consts; i++)
+                image_reach(interp, w, obj->consts[i]);
+            break;
+        default:
+            break;
+    }
+}
+
+void image_write_object(Interp* interp, ImageWriter* w, Object* obj) {
+    image_emit(w, obj->type | (uint64_t)obj->form << 8);
+    switch (obj->type) {
+        case TYPE_STRING:
+            image_emit_bytes(w, obj->str_val, strlen(obj->str_val));
+            break;
+        case TYPE_SYMBOL:
+            image_emit_bytes(w, obj->str_val, strlen(obj->str_val));
+            image_emit(w, image_ref(interp, w, w->symbol_values ? obj->value : unbound_obj));
+            break;
+        case TYPE_PAIR:
+            image_emit(w, image_ref(interp, w, obj->car));
+            image_emit(w, image_ref(interp, w, obj->cdr));
+            break;
+        case TYPE_PRIMITIVE: {
+            size_t index = 0;
+            while (index < NUM_PRIMITIVES && primitives[index].func != obj->func)
+                index++;
+            assert(index < NUM_PRIMITIVES, "primitive missing from table");
+            image_emit(w, index);
+            break;
+        }
+        case TYPE_PROCEDURE:
+            image_emit(w, image_ref(interp, w, obj->params));
+            image_emit(w, image_ref(interp, w, obj->body));
+            image_emit(w, image_ref(interp, w, obj->env));
+            image_emit(w, image_ref(interp, w, image_code(obj)));
+            image_emit(w, image_ref(interp, w, obj->proc_name));
+            image_emit(w, obj->frame_size);
+            break;
+        case TYPE_LOCALREF:
+        case TYPE_GLOBALREF:
+            image_emit(w, image_ref(interp, w, obj->name));
+            image_emit(w, obj->depth);
+            image_emit(w, obj->index);
+            break;
+        case TYPE_FRAME:
+            image_emit(w, obj->num_slots);
+            image_emit(w, image_ref(interp, w, obj->parent));
+            image_emit(w, image_ref(interp, w, obj->vars));
+            image_emit(w, image_ref(interp, w, obj->overflow));
+            for (int i = 0; i < obj->num_slots; i++)
+                image_emit(w, image_ref(interp, w, obj->slots[i]));
+            break;
+        case TYPE_CODE:
+            image_emit(w, obj->num_instrs);
+            image_emit(w, obj->num_consts);
+            image_emit(w, obj->num_caches);
+            image_emit(w, image_ref(interp, w, obj->lambda));
+            for (int i = 0; i < obj->num_consts; i++)
+                image_emit(w, image_ref(interp, w, obj->consts[i]));
+            image_emit_bytes(w, (char*)obj->instrs, obj->num_instrs * sizeof(int32_t));
+            break;
+        default:
+            raise_error("cannot write %s to an image", type_names[obj->type]);
+    }
+}
+
+// numbers everything reachable from the objects reached so far
+void image_reach_all(Interp* interp, ImageWriter* w) {
+    for (size_t i = 0; i < w->num_objects; i++)
+        image_reach_fields(interp, w, w->objects[i]);
+}
+
+void image_write_objects(Interp* interp, ImageWriter* w) {
+    for (size_t i = 0; i < w->num_objects; i++)
+        image_write_object(interp, w, w->objects[i]);
+}
+
+bool image_write_file(ImageWriter* w, char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL)
+        return false;
+    size_t written = fwrite(w->words, sizeof(uint64_t), w->num_words, file);
+    return fclose(file) == 0 && written == w->num_words;
+}
+
+void image_free(ImageWriter* w) {
+    free(w->objects);
+    free(w->index_keys);
+    free(w->index_values);
+    free(w->words);
+}
+
+void dump_image(Interp* interp, char* filename) {
+    ImageWriter w = {0};
+    w.symbol_values = true;
+    for (size_t i = 0; i < interp->heap->symbols.capacity; i++)
+        image_reach(interp, &w, interp->heap->symbols.entries[i]);
+    for (size_t i = 0; i < NUM_IMAGE_BUILTINS; i++)
+        image_reach_fields(interp, &w, image_builtin_object(interp, i));
+    image_reach_all(interp, &w);
+
+    image_emit(&w, IMAGE_MAGIC);
+    image_emit(&w, IMAGE_VERSION);
+    image_emit(&w, w.num_objects);
+    image_emit(&w, image_ref(interp, &w, interp->global_env->vars));
+    image_emit(&w, image_ref(interp, &w, interp->global_env->overflow));
+    image_write_objects(interp, &w);
+
+    if (!image_write_file(&w, filename)) {
+        fprintf(stderr, "could not write image: %s\n", filename);
+        exit(1);
+    }
+    image_free(&w);
+}
+
+Object* image_object(Interp* interp, Object** objects, size_t num_objects, uint64_t ref) {
+    if (ref == 0 || (ref & TAG_FIXNUM) || (ref & TAG_MASK) == TAG_CONSTANT)
+        return (Object*)(uintptr_t)ref;
+    if ((ref & TAG_MASK) == IMAGE_TAG_BUILTIN) {
+        assert((ref >> 3) < NUM_IMAGE_BUILTINS, "corrupt image");
+        return image_builtin_object(interp, ref >> 3);
+    }
+    assert((ref >> 3) - 1 < num_objects, "corrupt image");
+    return objects[(ref >> 3) - 1];
+}
+
+// fails unless n more words remain before end
+void image_need(const uint64_t* pos, const uint64_t* end, uint64_t n) {
+    assert(pos <= end && n <= (uint64_t)(end - pos), "corrupt image");
+}
+
+char* image_bytes(const uint64_t** pos, const uint64_t* end) {
+    image_need(*pos, end, 1);
+    size_t len = *(*pos)++;
+    image_need(*pos, end, len / sizeof(uint64_t) + (len % sizeof(uint64_t) != 0));
+    char* str = malloc(len + 1);
+    assert(str != NULL, "out of memory");
+    memcpy(str, *pos, len);
+    str[len] = '\0';
+    *pos += (len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    return str;
+}
+
+// Rebuilds num_objects records starting at pos in the heap and returns them
+// by number. The records are read in two passes: the first allocates every
+// object, the second fills in the pointer fields. The caller holds off
+// collection until the objects are reachable.
+Object** image_read_objects(Interp* interp, const uint64_t* pos, const uint64_t* end,
+                            size_t num_objects, bool symbol_values) {
+    // every record takes at least a word
+    image_need(pos, end, num_objects);
+    Object** objects = malloc((num_objects + 1) * sizeof(Object*));
+    const uint64_t** records = malloc((num_objects + 1) * sizeof(uint64_t*));
+    assert(objects != NULL && records != NULL, "out of memory");
+
+    for (size_t i = 0; i < num_objects; i++) {
+        image_need(pos, end, 1);
+        ObjectType object_type = *pos & 0xff;
+        uint8_t form = *pos >> 8;
+        pos++;
+        records[i] = pos;
+
+        Object* obj;
+        switch (object_type) {
+            case TYPE_STRING:
+                obj = new_string(interp, image_bytes(&pos, end));
+                break;
+            case TYPE_SYMBOL: {
+                char* name = image_bytes(&pos, end);
+                obj = new_symbol(interp, name);
+                free(name);
+                image_need(pos, end, 1);
+                pos++;
+                break;
+            }
+            case TYPE_PAIR:
+                image_need(pos, end, 2);
+                obj = cons(interp, NULL, NULL);
+                pos += 2;
+                break;
+            case TYPE_PRIMITIVE:
+                image_need(pos, end, 1);
+                assert(*pos < NUM_PRIMITIVES, "corrupt image");
+                objects[i] = interp->primitive_objects[*pos++];
+                continue;
+            case TYPE_PROCEDURE:
+                image_need(pos, end, 6);
+                obj = new_object(interp, TYPE_PROCEDURE);
+                pos += 6;
+                break;
+            case TYPE_LOCALREF:
+            case TYPE_GLOBALREF:
+                image_need(pos, end, 3);
+                obj = new_object(interp, object_type);
+                pos += 3;
+                break;
+            case TYPE_FRAME: {
+                image_need(pos, end, 4);
+                image_need(pos + 4, end, pos[0]);
+                int num_slots = *pos;
+                obj = allocate(interp, TYPE_FRAME,
+                               offsetof(Object, slots) + num_slots * sizeof(Object*));
+                obj->num_slots = num_slots;
+                pos += 4 + num_slots;
+                break;
+            }
+            case TYPE_CODE: {
+                image_need(pos, end, 4);
+                image_need(pos + 4, end, pos[1]);
+                // the instructions follow as bytes, and each cache belongs
+                // to a call instruction
+                assert(pos[0] <= INT_MAX && pos[2] <= pos[0], "corrupt image");
+                image_need(pos + 4 + pos[1], end, 1);
+                assert(pos[4 + pos[1]] == pos[0] * sizeof(int32_t), "corrupt image");
+                obj = new_object(interp, TYPE_CODE);
+                obj->num_instrs = pos[0];
+                obj->num_consts = pos[1];
+                obj->num_caches = pos[2];
+                pos += 4 + obj->num_consts;
+                obj->instrs = (int32_t*)image_bytes(&pos, end);
+                obj->consts = malloc(obj->num_consts * sizeof(Object*));
+                obj->caches = calloc(obj->num_caches, sizeof(CallCache));
+                obj->entries = 0;
+                obj->deopts = 0;
+                obj->native = NULL;
+                assert((obj->consts != NULL || obj->num_consts == 0) &&
+                       (obj->caches != NULL || obj->num_caches == 0), "out of memory");
+                break;
+            }
+            default:
+                raise_error("corrupt image");
+        }
+        obj->form = form;
+        objects[i] = obj;
+        assert(pos <= end, "corrupt image");
+    }
+
+    #define REF(k) image_object(interp, objects, num_objects, (k))
+    for (size_t i = 0; i < num_objects; i++) {
+        Object* obj = objects[i];
+        const uint64_t* fields = records[i];
+        switch (obj->type) {
+            case TYPE_SYMBOL:
+                fields += 1 + (fields[0] + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+                if (symbol_values)
+                    set_global(interp, obj, REF(fields[0]));
+                break;
+            case TYPE_PAIR:
+                obj->car = REF(fields[0]);
+                obj->cdr = REF(fields[1]);
+                break;
+            case TYPE_PROCEDURE:
+                obj->params = REF(fields[0]);
+                obj->body = REF(fields[1]);
+                obj->env = REF(fields[2]);
+                obj->code = REF(fields[3]);
+                obj->proc_name = REF(fields[4]);
+                obj->frame_size = fields[5];
+                break;
+            case TYPE_LOCALREF:
+            case TYPE_GLOBALREF:
+                obj->name = REF(fields[0]);
+                obj->depth = fields[1];
+                obj->index = fields[2];
+                break;
+            case TYPE_FRAME:
+                obj->parent = REF(fields[1]);
+                obj->vars = REF(fields[2]);
+                obj->overflow = REF(fields[3]);
+                for (int j = 0; j < obj->num_slots; j++)
+                    obj->slots[j] = REF(fields[4 + j]);
+                break;
+            case TYPE_CODE:
+                obj->lambda = REF(fields[3]);
+                for (int j = 0; j < obj->num_consts; j++)
+                    obj->consts[j] = REF(fields[4 + j]);
+                break;
+            default:
+                break;
+        }
+    }
+    #undef REF
+
+    free(records);
+    return objects;
+}
+
+// maps a whole file read-only, or returns NULL
+const uint64_t* image_map(char* filename, size_t* size) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+        return NULL;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fileno(file), &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    if (data == MAP_FAILED)
+        return NULL;
+    *size = st.st_size;
+    return data;
+}
+
+void load_image(Interp* interp, char* filename) {
+    size_t size;
+    const uint64_t* words = image_map(filename, &size);
+    if (words == NULL) {
+        fprintf(stderr, "could not open file: %s\n", filename);
+        exit(1);
+    }
+    if (size < 5 * sizeof(uint64_t) || words[0] != IMAGE_MAGIC || words[1] != IMAGE_VERSION) {
+        fprintf(stderr, "not a heap image: %s\n", filename);
+        exit(1);
+    }
+
+    gc_hold(interp);
+    size_t num_objects = words[2];
+    Object** objects = image_read_objects(interp, words + 5, words + size / sizeof(uint64_t),
+                                          num_objects, true);
+    interp->global_env->vars = image_object(interp, objects, num_objects, words[3]);
+    interp->global_env->overflow = image_object(interp, objects, num_objects, words[4]);
+    gc_release(interp);
+    free(objects);
+    munmap((void*)words, size);
+}
+
+/* Fasl */
+
+// load keeps the forms of each source file, expanded and resolved, in a
+// file.fasl next to it: a header naming the source's mtime, size and hash,
+// the forms as a list, then image records with the symbols' values left
+// out. A cache whose header does not match the source is rebuilt.
+
+uint64_t hash_source(const char* data, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+char* fasl_filename(char* filename) {
+    size_t len = strlen(filename);
+    char* fasl = malloc(len + sizeof(".fasl"));
+    assert(fasl != NULL, "out of memory");
+    memcpy(fasl, filename, len);
+    memcpy(fasl + len, ".fasl", sizeof(".fasl"));
+    return fasl;
+}
+
+// returns the cached forms, or NULL if there is no valid cache
+Object* fasl_read(Interp* interp, char* filename, struct stat* source, uint64_t hash) {
+    size_t size;
+    const uint64_t* words = image_map(filename, &size);
+    if (words == NULL)
+        return NULL;
+
+    Object* forms = NULL;
+    if (size >= 8 * sizeof(uint64_t) &&
+        words[0] == FASL_MAGIC && words[1] == FASL_VERSION &&
+        words[2] == (uint64_t)source->st_mtim.tv_sec &&
+        words[3] == (uint64_t)source->st_mtim.tv_nsec &&
+        words[4] == (uint64_t)source->st_size && words[5] == hash) {
+        gc_hold(interp);
+        size_t num_objects = words[6];
+        Object** objects = image_read_objects(interp, words + 8, words + size / sizeof(uint64_t),
+                                              num_objects, false);
+        forms = image_object(interp, objects, num_objects, words[7]);
+        gc_release(interp);
+        free(objects);
+    }
+    munmap((void*)words, size);
+    return forms;
+}
+
+// writing the cache is best effort: a source directory may be read-only. It
+// is written under a name unique to the process and interpreter, then
+// renamed, so an interpreter loading the same file never maps half a cache.
+void fasl_write(Interp* interp, char* filename, struct stat* source, uint64_t hash,
+                Object* forms) {
+    ImageWriter w = {0};
+    image_reach(interp, &w, forms);
+    image_reach_all(interp, &w);
+
+    image_emit(&w, FASL_MAGIC);
+    image_emit(&w, FASL_VERSION);
+    image_emit(&w, source->st_mtim.tv_sec);
+    image_emit(&w, source->st_mtim.tv_nsec);
+    image_emit(&w, source->st_size);
+    image_emit(&w, hash);
+    image_emit(&w, w.num_objects);
+    image_emit(&w, image_ref(interp, &w, forms));
+    image_write_objects(interp, &w);
+
+    char* temp = malloc(strlen(filename) + 64);
+    assert(temp != NULL, "out of memory");
+    sprintf(temp, "%s.%ld.%p", filename, (long)getpid(), (void*)interp);
+    if (!image_write_file(&w, temp) || rename(temp, filename) != 0)
+        remove(temp);
+    free(temp);
+    image_free(&w);
+}
+
+/* Futures */
+
+// A future is a heap object that a pool of worker threads runs as a task.
+// Each worker has an interpreter context of its own on the shared heap, so
+// a task reads and sets the same globals as the thread that made it, and
+// any object can go in or come out. What the task returns, or the message
+// of an error it raised, stays in the future: touch returns the value or
+// raises the error again in the toucher. A thread touching an unfinished
+// future runs queued tasks until it is done, starting with the awaited one
+// if no worker has.
+
+void deque_push(Deque* d, Object* future) {
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top == d->capacity) {
+        size_t capacity = d->capacity ? d->capacity * 2 : DEQUE_MIN_CAPACITY;
+        Object** futures = malloc(capacity * sizeof(Object*));
+        assert(futures != NULL, "out of memory");
+        for (size_t i = d->top; i < d->bottom; i++)
+            futures[i & (capacity - 1)] = d->futures[i & (d->capacity - 1)];
+        free(d->futures);
+        d->futures = futures;
+        d->capacity = capacity;
+    }
+    d->futures[d->bottom++ & (d->capacity - 1)] = future;
+    pthread_mutex_unlock(&d->lock);
+}
+
+// takes the newest future, as the owner does
+Object* deque_pop(Deque* d) {
+    Object* future = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top)
+        future = d->futures[--d->bottom & (d->capacity - 1)];
+    pthread_mutex_unlock(&d->lock);
+    return future;
+}
+
+// takes the oldest future, as a thief does
+Object* deque_steal(Deque* d) {
+    Object* future = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top)
+        future = d->futures[d->top++ & (d->capacity - 1)];
+    pthread_mutex_unlock(&d->lock);
+    return future;
+}
+
+Object* new_future(Interp* interp, TaskKind kind, Object* thunk) {
+    GC_PROTECT(thunk);
+    Object* future = new_object(interp, TYPE_FUTURE);
+    GC_UNPROTECT(1);
+    future->thunk = thunk;
+    future->future_value = NULL;
+    future->error = NULL;
+    future->state = TASK_QUEUED;
+    future->task_kind = kind;
+    return future;
+}
+
+// whoever claims a queued task runs it; its deque entry is dropped when
+// taken
+bool claim_task(Object* future) {
+    int queued = TASK_QUEUED;
+    return __atomic_compare_exchange_n(&future->state, &queued, TASK_RUNNING, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// calls proc with no arguments, or with arg, on the interpreter's engine
+Object* call_procedure(Interp* interp, Object* proc, Object* arg) {
+    size_t num_roots = interp->gc.num_roots;
+    GC_PROTECT(proc);
+    Object* exp = empty_list;
+    GC_PROTECT(exp);
+    if (arg != NULL) {
+        exp = cons(interp, arg, empty_list);
+        exp = cons(interp, interp->quote_symbol, exp);
+        exp = cons(interp, exp, empty_list);
+    }
+    exp = cons(interp, proc, exp);
+    Object* result = eval_toplevel(interp, exp);
+    interp->gc.num_roots = num_roots;
+    return result;
+}
+
+// runs a claimed task on this thread, keeping an error it raises in the
+// future rather than letting it end the thread
+void run_task(Interp* interp, Object* future) {
+    Pool* pool = &interp->heap->pool;
+    Object* thunk = future->thunk;
+    Object* result = empty_list;
+    GC_PROTECT(future);
+    GC_PROTECT(thunk);
+    GC_PROTECT(result);
+
+    ErrorHandler handler;
+    install_handler(interp, &handler);
+    if (setjmp(handler.env) == 0) {
+        if (future->task_kind == TASK_CALL) {
+            result = call_procedure(interp, thunk, NULL);
+        } else {
+            for (Object* args = cdr(thunk); args != empty_list; args = cdr(args)) {
+                Object* value = call_procedure(interp, car(thunk), car(args));
+                if (future->task_kind == TASK_MAP)
+                    result = cons(interp, value, result);
+            }
+            result = future->task_kind == TASK_MAP ? reverse_list(result) : interp->ok_symbol;
+        }
+        remove_handler(&handler);
+        future->future_value = result;
+    } else {
+        future->error = strdup(handler.message);
+        assert(future->error != NULL, "out of memory");
+    }
+    future->thunk = NULL;
+    GC_UNPROTECT(3);
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&future->state, TASK_DONE, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// the worker's own newest task, else the oldest of another deque
+Object* take_task(Interp* interp) {
+    Pool* pool = &interp->heap->pool;
+    int self = interp->worker;
+    Object* future = self >= 0 ? deque_pop(&pool->deques[self]) : NULL;
+    for (int i = 1; future == NULL && i <= pool->num_workers; i++) {
+        int victim = ((self >= 0 ? self : 0) + i) % pool->num_workers;
+        future = deque_steal(&pool->deques[victim]);
+    }
+    if (future != NULL)
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    return future;
+}
+
+// runs a task taken from a deque, unless a waiting thread got to it first
+void run_taken(Interp* interp, Object* future) {
+    if (claim_task(future))
+        run_task(interp, future);
+}
+
+void* worker_main(void* arg) {
+    Interp* interp = arg;
+    Pool* pool = &interp->heap->pool;
+    init_stack_limit();
+    gc_enter(interp);
+    while (!__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE)) {
+        Object* future = take_task(interp);
+        if (future != NULL) {
+            run_taken(interp, future);
+            continue;
+        }
+        gc_leave(interp);
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0 && !pool->shutdown)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        gc_enter(interp);
+    }
+    gc_leave(interp);
+    return NULL;
+}
+
+// starts the heap's workers, each on a context of its own, once the first
+// task comes
+void pool_start(Interp* interp) {
+    Pool* pool = &interp->heap->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->started) {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    if (pool->num_workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        pool->num_workers = cores > 0 ? cores : 1;
+    }
+    pool->deques = calloc(pool->num_workers, sizeof(Deque));
+    pool->workers = calloc(pool->num_workers, sizeof(Interp*));
+    pool->threads = calloc(pool->num_workers, sizeof(pthread_t));
+    assert(pool->deques != NULL && pool->workers != NULL && pool->threads != NULL,
+           "out of memory");
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i] = new_thread_interp(interp);
+        pool->workers[i]->worker = i;
+    }
+    for (int i = 0; i < pool->num_workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool->workers[i]) != 0) {
+            fprintf(stderr, "could not start worker thread\n");
+            exit(1);
+        }
+    }
+    __atomic_store_n(&pool->started, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// stops the workers and frees their contexts: each finishes the task it is
+// running, or fails it at its next allocation or wait
+void pool_stop(Interp* interp) {
+    Heap* heap = interp->heap;
+    Pool* pool = &heap->pool;
+    if (!pool->started)
+        return;
+
+    pthread_mutex_lock(&heap->lock);
+    for (int i = 0; i < pool->num_workers; i++)
+        __atomic_store_n(&pool->workers[i]->gc.allowance, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&heap->lock);
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->shutdown, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->work);
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+
+    gc_leave(interp);
+    for (int i = 0; i < pool->num_workers; i++)
+        pthread_join(pool->threads[i], NULL);
+    gc_enter(interp);
+
+    heap->threads = interp;
+    interp->next_thread = NULL;
+    heap->num_threads = 1;
+    for (int i = 0; i < pool->num_workers; i++) {
+        free_thread_interp(pool->workers[i]);
+        free(pool->deques[i].futures);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    free(pool->workers);
+    free(pool->threads);
+    free(pool->deques);
+    pool->started = false;
+}
+
+// queues a task on this worker's deque, or spreads tasks from outside the
+// pool over all of them
+void submit_task(Interp* interp, Object* future) {
+    Pool* pool = &interp->heap->pool;
+    if (!__atomic_load_n(&pool->started, __ATOMIC_ACQUIRE))
+        pool_start(interp);
+    int self = interp->worker;
+    if (self < 0)
+        self = __atomic_fetch_add(&pool->next_deque, 1, __ATOMIC_RELAXED) % pool->num_workers;
+    deque_push(&pool->deques[self], future);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// returns once the rooted future's task is done, running it or other queued
+// tasks meanwhile
+void wait_task(Interp* interp, Object* future) {
+    Pool* pool = &interp->heap->pool;
+    while (__atomic_load_n(&future->state, __ATOMIC_ACQUIRE) != TASK_DONE) {
+        if (claim_task(future)) {
+            run_task(interp, future);
+            return;
+        }
+        Object* other = take_task(interp);
+        if (other != NULL) {
+            run_taken(interp, other);
+            continue;
+        }
+        gc_leave(interp);
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&future->state, __ATOMIC_ACQUIRE) != TASK_DONE &&
+               !pool->shutdown)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        gc_enter(interp);
+        if (__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&future->state, __ATOMIC_ACQUIRE) != TASK_DONE)
+            raise_error("interpreter shut down");
+    }
+}
+
+Object* spawn_future(Interp* interp, Object* thunk) {
+    Object* future = new_future(interp, TASK_CALL, thunk);
+    submit_task(interp, future);
+    return future;
+}
+
+// the future's value, or its task's error raised again here
+Object* touch_future(Interp* interp, Object* future) {
+    if (__atomic_load_n(&future->state, __ATOMIC_ACQUIRE) != TASK_DONE) {
+        GC_PROTECT(future);
+        wait_task(interp, future);
+        GC_UNPROTECT(1);
+    }
+    if (future->error != NULL)
+        raise_error("%s", future->error);
+    return future->future_value;
+}
+
+// maps proc over list in tasks of consecutive elements, and returns the
+// values in order for TASK_MAP, ok for TASK_FOR_EACH. Every task is waited
+// for before the first error is raised, so none is still calling proc when
+// the caller carries on.
+Object* parallel_map(Interp* interp, Object* proc, Object* list, TaskKind kind) {
+    size_t length = 0;
+    for (Object* l = list; l != empty_list; l = cdr(l)) {
+        assert(type(l) == TYPE_PAIR, "proc pmap expected list");
+        length++;
+    }
+    if (length == 0)
+        return kind == TASK_MAP ? empty_list : interp->ok_symbol;
+
+    Pool* pool = &interp->heap->pool;
+    if (!__atomic_load_n(&pool->started, __ATOMIC_ACQUIRE))
+        pool_start(interp);
+    size_t num_tasks = (size_t)pool->num_workers * PMAP_TASKS_PER_WORKER;
+    if (num_tasks > length)
+        num_tasks = length;
+
+    size_t num_roots = interp->gc.num_roots;
+    GC_PROTECT(proc);
+    GC_PROTECT(list);
+    Object* futures = empty_list;
+    GC_PROTECT(futures);
+    Object* rest = list;
+    for (size_t i = 0; i < num_tasks; i++) {
+        size_t count = length / num_tasks + (i < length % num_tasks);
+        Object* input = cons(interp, proc, empty_list);
+        GC_PROTECT(input);
+        Object* last = input;
+        for (size_t j = 0; j < count; j++, rest = cdr(rest)) {
+            last->cdr = cons(interp, car(rest), empty_list);
+            last = last->cdr;
+        }
+        Object* future = new_future(interp, kind, input);
+        GC_PROTECT(future);
+        futures = cons(interp, future, futures);
+        GC_UNPROTECT(2);
+        submit_task(interp, future);
+    }
+    futures = reverse_list(futures);
+    for (Object* f = futures; f != empty_list; f = cdr(f))
+        wait_task(interp, car(f));
+
+    Object* result = empty_list;
+    Object* last = NULL;
+    for (Object* f = futures; f != empty_list; f = cdr(f)) {
+        Object* future = car(f);
+        if (future->error != NULL)
+            raise_error("%s", future->error);
+        Object* values = future->future_value;
+        if (kind != TASK_MAP || values == empty_list)
+            continue;
+        if (last == NULL)
+            result = values;
+        else
+            last->cdr = values;
+        for (last = values; cdr(last) != empty_list; last = cdr(last))
+            ;
+    }
+    interp->gc.num_roots = num_roots;
+    return kind == TASK_MAP ? result : interp->ok_symbol;
+}
+
+/* Printing */
+
+void write_object(FILE* stream, Object* obj) {
+    if (!obj) return;
+
+    switch(type(obj)) {
+        case TYPE_INT: fprintf(stream, "%d", fixnum_val(obj)); break;
+        case TYPE_BOOL:  fprintf(stream, "%s", obj == true_obj ? "#t" : "#f"); break;
+        case TYPE_STRING: fprintf(stream, "\"%s\"", obj->str_val); break;
+        case TYPE_SYMBOL: fprintf(stream, "%s", obj->str_val); break;
+        case TYPE_EMPTYLIST: fprintf(stream, "()"); break;
+        case TYPE_PROCEDURE:
+        case TYPE_PRIMITIVE: fprintf(stream, "#<procedure>"); break;
+        case TYPE_FUTURE: fprintf(stream, "#<future>"); break;
+        case TYPE_PAIR:
+            fputc('(', stream);
+
+            Object* o = obj;
+            while (type(cdr(o)) == TYPE_PAIR && cdr(o) != empty_list) {
+                write_object(stream, car(o));
+                fputc(' ', stream);
+                o = cdr(o);
+            }
+
+            if (cdr(o) == empty_list) {
+                write_object(stream, car(o));
+            } else {
+                write_object(stream, car(o));
+                fprintf(stream, " . ");
+                write_object(stream, cdr(o));
+            }
+            fputc(')', stream);
+            break;
+        default:
+            raise_error("unexpected type: [%s]", type_names[type(obj)]);
+    }
+}
+
+void print_object(Object* obj) {
+    write_object(stdout, obj);
+}
+
+/* Server */
+
+// -serve answers requests on a Unix socket from the interpreter as -image
+// and -f left it, so a request costs only its own evaluation. A request is
+// source text ended by a NUL byte; its forms are evaluated in order and
+// their printed values sent back a line at a time, then a NUL. A client may
+// send requests without waiting for the answers: each connection's answers
+// are queued and sent as its client takes them, and one that leaves them
+// unread only stops its own requests being read. One interpreter serves
+// every connection, a request at a time, so a definition made by one
+// request is seen by the requests after it. An error ends its request: the
+// message is sent as the last line before the NUL, and the server carries
+// on. A request that stops inside a form is refused before any of it runs.
+
+int serve_listen(char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    // a socket left behind by an earlier server is replaced
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "could not listen on socket: %s\n", path);
+        exit(1);
+    }
+    return fd;
+}
+
+// evaluates one request and queues its answer on the connection; what the
+// forms print goes to the answer rather than to stdout
+void serve_request(Interp* interp, Connection* conn, char* request, size_t len) {
+    char* answer = NULL;
+    size_t answer_len = 0;
+    FILE* out = open_memstream(&answer, &answer_len);
+    assert(out != NULL, "out of memory");
+    interp->out = out;
+
+    ErrorHandler handler;
+    install_handler(interp, &handler);
+    if (setjmp(handler.env) == 0) {
+        if (!input_complete(request, len))
+            raise_error("unexpected end of input");
+        LexState ls = {};
+        lex_open_buffer(&ls, request, len);
+        eval_all(interp, &ls, true);
+        remove_handler(&handler);
+    } else {
+        fprintf(out, "%s\n", handler.message);
+    }
+    fputc('\0', out);
+    fclose(out);
+    interp->out = stdout;
+
+    if (conn->out_len + answer_len > conn->out_capacity) {
+        while (conn->out_len + answer_len > conn->out_capacity)
+            conn->out_capacity = conn->out_capacity ? conn->out_capacity * 2 : LEX_BLOCK_SIZE;
+        conn->out = realloc(conn->out, conn->out_capacity);
+        assert(conn->out != NULL, "out of memory");
+    }
+    memcpy(conn->out + conn->out_len, answer, answer_len);
+    conn->out_len += answer_len;
+    free(answer);
+}
+
+// reads what the client has sent and answers the whole requests in it;
+// returns false once the client has closed its end
+bool serve_connection(Interp* interp, Connection* conn) {
+    if (conn->len == conn->capacity) {
+        conn->capacity = conn->capacity ? conn->capacity * 2 : LEX_BLOCK_SIZE;
+        conn->buf = realloc(conn->buf, conn->capacity);
+        assert(conn->buf != NULL, "out of memory");
+    }
+    ssize_t n = read(conn->fd, conn->buf + conn->len, conn->capacity - conn->len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+    if (n > 0)
+        conn->len += n;
+
+    char* start = conn->buf;
+    char* end;
+    while ((end = memchr(start, '\0', conn->buf + conn->len - start)) != NULL) {
+        serve_request(interp, conn, start, end - start);
+        start = end + 1;
+    }
+    conn->len -= start - conn->buf;
+    memmove(conn->buf, start, conn->len);
+    return n > 0;
+}
+
+// sends as much of the connection's answers as the socket takes without
+// blocking; returns false if the client has gone
+bool serve_flush(Connection* conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = write(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->out_sent += n;
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    return true;
+}
+
+void serve(Interp* interp, char* path) {
+    int listener = serve_listen(path);
+    // a client that goes away before its answer is only dropped
+    signal(SIGPIPE, SIG_IGN);
+    // the server runs until killed, so what -f printed goes out now
+    fflush(stdout);
+
+    // fds[0] is the listener and fds[i] the connection conns[i]
+    size_t num_fds = 1;
+    size_t capacity = 16;
+    struct pollfd* fds = malloc(capacity * sizeof(struct pollfd));
+    Connection* conns = malloc(capacity * sizeof(Connection));
+    assert(fds != NULL && conns != NULL, "out of memory");
+    fds[0] = (struct pollfd){.fd = listener, .events = POLLIN};
+
+    for (;;) {
+        // tasks left running collect without this thread while it waits
+        gc_leave(interp);
+        int ready = poll(fds, num_fds, -1);
+        gc_enter(interp);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "could not poll: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // a connection is read while its client takes its answers, and
+        // dropped once it has closed and been answered, or has gone
+        for (size_t i = num_fds - 1; i > 0; i--) {
+            Connection* conn = &conns[i];
+            if (fds[i].revents == 0)
+                continue;
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !conn->closed &&
+                !serve_connection(interp, conn))
+                conn->closed = true;
+            if (serve_flush(conn) && !(conn->closed && conn->out_len == 0)) {
+                size_t unsent = conn->out_len - conn->out_sent;
+                fds[i].events = (conn->closed || unsent >= SERVE_OUTPUT_MAX ? 0 : POLLIN) |
+                                (unsent > 0 ? POLLOUT : 0);
+                continue;
+            }
+            close(conn->fd);
+            free(conn->buf);
+            free(conn->out);
+            num_fds--;
+            fds[i] = fds[num_fds];
+            conns[i] = conns[num_fds];
+        }
+
+        if (fds[0].revents != 0) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                fprintf(stderr, "could not accept connection: %s\n", strerror(errno));
+                exit(1);
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            if (num_fds == capacity) {
+                capacity *= 2;
+                fds = realloc(fds, capacity * sizeof(struct pollfd));
+                conns = realloc(conns, capacity * sizeof(Connection));
+                assert(fds != NULL && conns != NULL, "out of memory");
+            }
+            fds[num_fds] = (struct pollfd){.fd = fd, .events = POLLIN};
+            conns[num_fds] = (Connection){.fd = fd};
+            num_fds++;
+        }
+    }
+}
+
+/* Main */
+
+// expands and resolves the next top-level form, or returns NULL at the end
+Object* read_form(Interp* interp, LexState* ls) {
+    if (ls->token.kind == TK_EOF)
+        return NULL;
+    Object* exp = parse_exp(interp, ls);
+    exp = expand(interp, exp);
+    return resolve(interp, exp, empty_list);
+}
+
+void eval_form(Interp* interp, Object* exp, bool verbose) {
+    Object* result = eval_toplevel(interp, exp);
+    if (result && verbose) {
+        write_object(interp->out, result);
+        fputc('\n', interp->out);
+    }
+}
+
+void eval_all(Interp* interp, LexState* ls, bool verbose) {
+    next_token(interp, ls);
+    Object* exp;
+    while ((exp = read_form(interp, ls)) != NULL)
+        eval_form(interp, exp, verbose);
+}
+
+// evaluates a source file through its fasl cache, which is rebuilt when the
+// source has changed
+void load_file(Interp* interp, char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+        raise_error("could not open file: %s", filename);
+
+    struct stat st;
+    LexState ls = {};
+    assert(fstat(fileno(file), &st) == 0, "could not stat file");
+    lex_open_file(&ls, file);
+    fclose(file);
+
+    uint64_t hash = hash_source(ls.cur, ls.end - ls.cur);
+    char* fasl = fasl_filename(filename);
+    Object* forms = fasl_read(interp, fasl, &st, hash);
+    GC_PROTECT(forms);
+    if (forms != NULL) {
+        lex_close(&ls);
+        free(fasl);
+        for (Object* f = forms; f != empty_list; f = cdr(f))
+            eval_form(interp, car(f), false);
+        GC_UNPROTECT(1);
+        return;
+    }
+
+    // without a cache each form runs as it is read, as under -f, so an
+    // error leaves the forms before it run; the cache is written only once
+    // every form has
+    ErrorHandler handler;
+    install_handler(interp, &handler);
+    if (setjmp(handler.env) != 0) {
+        lex_close(&ls);
+        free(fasl);
+        raise_error("%s", handler.message);
+    }
+    forms = empty_list;
+    Object* last = NULL;
+    Object* exp;
+    next_token(interp, &ls);
+    while ((exp = read_form(interp, &ls)) != NULL) {
+        Object* cell = cons(interp, exp, empty_list);
+        if (last == NULL)
+            forms = cell;
+        else
+            last->cdr = cell;
+        last = cell;
+        eval_form(interp, exp, false);
+    }
+    remove_handler(&handler);
+
+    fasl_write(interp, fasl, &st, hash, forms);
+    lex_close(&ls);
+    free(fasl);
+    GC_UNPROTECT(1);
+}
+
+size_t parse_size(char* arg) {
+    char* end;
+    size_t size = strtoull(arg, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': size *= 1024; end++; break;
+        case 'm': case 'M': size *= 1024 * 1024; end++; break;
+        case 'g': case 'G': size *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (end == arg || *end != '\0') {
+        fprintf(stderr, "invalid size: %s\n", arg);
+        exit(1);
+    }
+    return size;
+}
+
+void usage() {
+    fprintf(stderr,
+            "usage: bss [options] [-f file]\n"
+            "  -f file           evaluate file and print each result\n"
+            "  -heap size        maximum live heap size (0 = unlimited)\n"
+            "  -gc-trigger size  bytes allocated between collections (0 = every allocation)\n"
+            "  -engine name      vm (bytecode, default) or analyze (analyzed tree)\n"
+            "  -no-optimize      skip constant folding and inlining of primitives\n"
+            "  -no-jit           run hot procedures on the VM instead of as native code\n"
+            "  -image file       start from a heap image instead of a fresh heap\n"
+            "  -dump file        write the heap to an image after running, no REPL\n"
+            "  -stats            print allocation, call and GC counters at exit\n"
+            "  -profile file     time procedure calls, write folded stacks to file\n"
+            "                    and a table of calls and times to stderr\n"
+            "  -workers n        threads running futures (default: one per core)\n"
+            "  -serve path       after running, answer requests on a Unix socket\n"
+            "sizes accept a k, m or g suffix\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    char* filename = NULL;
+    char* image_file = NULL;
+    char* dump_file = NULL;
+    char* serve_path = NULL;
+    bool show_stats = false;
+    init_stack_limit();
+    Interp* interp = new_interp();
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-stats")) {
+            show_stats = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-no-optimize")) {
+            interp->optimize = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-no-jit")) {
+            interp->jit = false;
+            continue;
+        }
+        if (i + 1 == argc)
+            usage();
+
+        if (!strcmp(argv[i], "-f")) {
+            filename = argv[++i];
+        } else if (!strcmp(argv[i], "-heap")) {
+            interp->heap->heap_max = parse_size(argv[++i]);
+        } else if (!strcmp(argv[i], "-gc-trigger")) {
+            interp->heap->trigger = parse_size(argv[++i]);
+            interp->heap->next_collection = interp->heap->trigger;
+        } else if (!strcmp(argv[i], "-image")) {
+            image_file = argv[++i];
+        } else if (!strcmp(argv[i], "-profile")) {
+            interp->profiler.enabled = true;
+            interp->profiler.filename = argv[++i];
+        } else if (!strcmp(argv[i], "-workers")) {
+            interp->heap->pool.num_workers = atoi(argv[++i]);
+            if (interp->heap->pool.num_workers <= 0)
+                usage();
+        } else if (!strcmp(argv[i], "-serve")) {
+            serve_path = argv[++i];
+        } else if (!strcmp(argv[i], "-dump")) {
+            dump_file = argv[++i];
+        } else if (!strcmp(argv[i], "-engine")) {
+            char* name = argv[++i];
+            if (!strcmp(name, "vm"))
+                interp->engine = ENGINE_VM;
+            else if (!strcmp(name, "analyze"))
+                interp->engine = ENGINE_ANALYZE;
+            else
+                usage();
+        } else {
+            usage();
+        }
+    }
+
+    init(interp);
+    if (image_file)
+        load_image(interp, image_file);
+
+    LexState ls = {};
+    if (filename) {
+        FILE* file = fopen(filename, "r");
+        if (file == NULL) {
+            fprintf(stderr, "could not open file: %s\n", filename);
+            exit(1);
+        }
+
+        lex_open_file(&ls, file);
+        fclose(file);
+        eval_all(interp, &ls, true);
+        lex_close(&ls);
+    }
+    if (serve_path) {
+        serve(interp, serve_path);
+    } else if (!filename && !dump_file) {
+        printf("Welcome to Bootstrap Scheme\n\n");
+
+        // lines are gathered until they hold whole forms, so a form may
+        // span several lines
+        char* line = NULL;
+        size_t capacity = 0;
+        char* buf = NULL;
+        size_t buf_len = 0;
+        ssize_t len;
+        printf("> ");
+        for (;;) {
+            // a worker collecting need not wait for the next line
+            gc_leave(interp);
+            len = getline(&line, &capacity, stdin);
+            gc_enter(interp);
+            if (len < 0)
+                break;
+            buf = realloc(buf, buf_len + len);
+            assert(buf != NULL, "out of memory");
+            memcpy(buf + buf_len, line, len);
+            buf_len += len;
+            if (!input_complete(buf, buf_len))
+                continue;
+            lex_open_buffer(&ls, buf, buf_len);
+            eval_all(interp, &ls, true);
+            buf_len = 0;
+            printf("> ");
+        }
+        if (buf_len > 0) {
+            lex_open_buffer(&ls, buf, buf_len);
+            eval_all(interp, &ls, true);
+        }
+        free(buf);
+        free(line);
+    }
+
+    if (interp->profiler.enabled)
+        profile_report(interp);
+    if (show_stats)
+        stats_report(interp, stderr);
+    if (dump_file)
+        dump_image(interp, dump_file);
 
+    free_interp(interp);
     return 0;
 }
@@ -1,13 +1,16 @@
 #ifndef BSS_H
 #define BSS_H
 
+#include <setjmp.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+__attribute__((noreturn))
+void raise_error(const char* format, ...);
 
 void assert(int condition, const char* message) {
-    if (!condition) {
-        printf("%s\n", message);
-        exit(1);
-    }
+    if (!condition)
+        raise_error("%s", message);
 }
 
 const bool valid_chars[] = {
@@ -31,7 +34,14 @@ typedef enum ObjectType {
     TYPE_EMPTYLIST,
     TYPE_PAIR,
     TYPE_PRIMITIVE,
-    TYPE_PROCEDURE
+    TYPE_PROCEDURE,
+    TYPE_LOCALREF,
+    TYPE_GLOBALREF,
+    TYPE_FRAME,
+    TYPE_CODE,
+    TYPE_NODE,
+    TYPE_FUTURE,
+    TYPE_FREE
 } ObjectType;
 
 const char* type_names[] = {
@@ -43,27 +53,165 @@ const char* type_names[] = {
     [TYPE_PAIR] = "TYPE_PAIR",
     [TYPE_PRIMITIVE] = "TYPE_PRIMITIVE",
     [TYPE_PROCEDURE] = "TYPE_PROCEDURE",
+    [TYPE_LOCALREF] = "TYPE_LOCALREF",
+    [TYPE_GLOBALREF] = "TYPE_GLOBALREF",
+    [TYPE_FRAME] = "TYPE_FRAME",
+    [TYPE_CODE] = "TYPE_CODE",
+    [TYPE_NODE] = "TYPE_NODE",
+    [TYPE_FUTURE] = "TYPE_FUTURE",
+    [TYPE_FREE] = "TYPE_FREE",
 };
 
+// special form ids, looked up through the form field of the keyword symbol
+typedef enum SpecialForm {
+    FORM_NONE = 0,
+    FORM_QUOTE,
+    FORM_DEFINE,
+    FORM_SET,
+    FORM_IF,
+    FORM_COND,
+    FORM_LAMBDA,
+    FORM_LET,
+    FORM_APPLY,
+    FORM_BEGIN,
+    FORM_LET_STAR,
+    FORM_LETREC,
+    FORM_AND,
+    FORM_OR,
+    FORM_INLINE
+} SpecialForm;
+
+struct ExecState;
+struct Interp;
+struct CallCache;
+struct NativeCode;
+
 typedef struct Object {
     ObjectType type;
+    bool marked;
+    uint8_t form;
     union {
-        int int_val;
-        bool bool_val;
-        char* str_val;
-        struct Object* (*func)(struct Object* args);
+        // strings use str_val only; a symbol also keeps its hash and its
+        // global value, which is unbound_obj until the symbol is defined
+        struct {
+            char* str_val;
+            uint32_t hash;
+            struct Object* value;
+        };
+        // primitive: called with its arguments in an array, after checking
+        // that there are between min_args and max_args of them
+        struct {
+            struct Object* (*func)(struct Interp* interp, int argc, struct Object** argv);
+            int min_args;
+            int max_args;
+            const char* prim_name;
+        };
+        // compound procedure; name is the symbol it was first defined as,
+        // or NULL for a lambda that was never defined
         struct {
             struct Object* params;
             struct Object* body;
             struct Object* env;
+            struct Object* code;
+            struct Object* proc_name;
+            int frame_size;
+        };
+        // compiled procedure body or top-level form; lambda is the resolved
+        // (lambda params body...) it came from, or NULL at top level, and
+        // caches has one entry per call to a global. entries counts calls
+        // until the JIT translates the code into native, and deopts the
+        // times its native code was dropped
+        struct {
+            int32_t* instrs;
+            struct Object** consts;
+            struct Object* lambda;
+            struct CallCache* caches;
+            int num_instrs;
+            int num_consts;
+            int num_caches;
+            int16_t entries;
+            int16_t deopts;
+            struct NativeCode* native;
+        };
+        // analyzed expression: exec runs it with the operands extracted
+        // when it was analyzed
+        struct {
+            struct Object* (*exec)(struct Interp* interp, struct Object* node,
+                                   struct ExecState* k);
+            struct Object* operand;
+            int op_depth;
+            int op_index;
+            int num_children;
+            struct Object* children[];
         };
         struct {
             struct Object* car;
             struct Object* cdr;
         };
+        // future: a task that calls thunk, or for pmap applies the car of
+        // thunk to each element of its cdr, and keeps the value or the
+        // message of the error it raised once state is TASK_DONE
+        struct {
+            struct Object* thunk;
+            struct Object* future_value;
+            char* error;
+            int state;
+            int task_kind;
+        };
+        // variable reference resolved before evaluation: a global reads the
+        // value cell of its symbol, a local a slot counted from the innermost
+        // frame
+        struct {
+            struct Object* name;
+            int depth;
+            int index;
+        };
+        // environment frame: one slot per parameter and internal definition,
+        // named by vars, plus a (vars . vals) overflow for other definitions;
+        // the global frame is empty since globals live in their symbols
+        struct {
+            struct Object* parent;
+            struct Object* vars;
+            struct Object* overflow;
+            int num_slots;
+            struct Object* slots[];
+        };
     };
 } Object;
 
+// max_args of a primitive that takes any number of arguments
+#define VARIADIC -1
+
+// primitive calls the optimizer can replace with an operation done in place
+typedef enum InlineOp {
+    INLINE_ADD,
+    INLINE_SUB,
+    INLINE_MUL,
+    INLINE_EQUALS,
+    INLINE_LESS_THAN,
+    INLINE_IS_NULL,
+    INLINE_IS_EQ,
+    INLINE_IS_PAIR,
+    INLINE_CAR,
+    INLINE_CDR,
+    INLINE_CONS
+} InlineOp;
+
+// the primitive an inline operation stands for, called with argc arguments
+typedef struct InlineDef {
+    struct Object* (*func)(struct Interp* interp, int argc, struct Object** argv);
+    int argc;
+} InlineDef;
+
+// built-in procedures, registered by init in table order; heap images refer
+// to a primitive by its index in the table
+typedef struct PrimitiveDef {
+    char* name;
+    Object* (*func)(struct Interp* interp, int argc, Object** argv);
+    int min_args;
+    int max_args;
+} PrimitiveDef;
+
 typedef enum {
     TK_NONE = 0,
     TK_QUOTE = '\'',
@@ -87,15 +235,526 @@ typedef struct Token {
     };
 } Token;
 
+// the lexer scans a whole source held in memory: an mmap of the file when
+// possible, otherwise a buffer filled by block reads; data is what to unmap
+// or free once the source is done
 typedef struct LexState {
-    FILE* stream;
+    const char* cur;
+    const char* end;
     Token token;
+    void* data;
+    size_t size;
+    bool mapped;
 } LexState;
 
-Object* parse_exp(LexState* ls);
+#define LEX_BLOCK_SIZE (64 * 1024)
+
+// Heap objects are at least 8-byte aligned, so the low bits of an Object*
+// are free to tag values that are stored directly in the pointer word:
+//   ...xx1  fixnum, the integer is the remaining bits
+//   ..x010  constant: #f, #t or the empty list
+//   ...000  pointer to a heap object
+#define TAG_MASK 0x7
+#define TAG_FIXNUM 0x1
+#define TAG_CONSTANT 0x2
+
+#define is_immediate(x) (((uintptr_t)(x) & TAG_MASK) != 0)
+#define is_fixnum(x) (((uintptr_t)(x) & TAG_FIXNUM) != 0)
+#define make_fixnum(n) ((Object*)(uintptr_t)((intptr_t)(n) * 2 + TAG_FIXNUM))
+#define fixnum_val(x) ((int)((intptr_t)(x) >> 1))
+
+#define false_obj ((Object*)(uintptr_t)(0x00 | TAG_CONSTANT))
+#define true_obj ((Object*)(uintptr_t)(0x08 | TAG_CONSTANT))
+#define empty_list ((Object*)(uintptr_t)(0x10 | TAG_CONSTANT))
+// value of a variable that has a slot but has not been defined yet
+#define unbound_obj ((Object*)(uintptr_t)(0x18 | TAG_CONSTANT))
+// returned by an exec function that left the next node to run in its
+// ExecState instead of recursing
+#define tail_call_obj ((Object*)(uintptr_t)(0x20 | TAG_CONSTANT))
+
+// objects live in chunks carved into equally sized cells, one size class per
+// chunk; anything larger than the biggest class gets a chunk of its own
+#define CHUNK_SIZE (64 * 1024)
+#define CHUNK_ALIGN 64
+#define NUM_SIZE_CLASSES 9
+#define LARGE_SIZE_CLASS NUM_SIZE_CLASSES
+
+const size_t size_classes[NUM_SIZE_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256
+};
+
+// a chunk with num_free cells left by the sweep is on a partial list for
+// its size class, the heap's and then a thread's, until the thread takes
+// them all as its free list
+typedef struct Chunk {
+    struct Chunk* next;
+    struct Chunk* next_partial;
+    Object* free_cells;
+    size_t num_free;
+    int size_class;
+    size_t cell_size;
+    size_t live_cells;
+    char* cells;
+    char* bump;
+    char* limit;
+} Chunk;
+
+// interned symbols, open addressing with linear probing
+typedef struct SymbolTable {
+    Object** entries;
+    size_t capacity;
+    size_t count;
+} SymbolTable;
+
+#define SYMBOL_TABLE_MIN_CAPACITY 1024
+
+// what one thread allocates from: the chunk it bump allocates from, the
+// swept chunks it took from the heap and the free cells of the one in use,
+// per size class, and whether the heap may still have swept chunks of the
+// class for it to take. Its bytes are added to the heap's
+// count once they reach allowance, which a collector waiting for the thread
+// sets to zero; while held is non-zero the thread does not stop for one.
+typedef struct GCState {
+    Chunk* current[NUM_SIZE_CLASSES];
+    Chunk* partial[NUM_SIZE_CLASSES];
+    Object* free_lists[NUM_SIZE_CLASSES];
+    bool swept[NUM_SIZE_CLASSES];
+    size_t bytes_allocated;
+    size_t allowance;
+    int held;
+
+    Object*** roots;
+    size_t num_roots;
+    size_t roots_capacity;
+} GCState;
+
+// a thread allocating alongside others accounts to the heap at least this
+// often
+#define GC_ALLOWANCE_SLICE (64 * 1024)
+
+// counters kept while running, reported by (runtime-stats) and -stats;
+// evals counts nodes run by the analyzing evaluator or instructions run by
+// the VM, depth the nesting of VM frames or evaluator calls
+typedef struct RuntimeStats {
+    size_t allocations[TYPE_FREE];
+    size_t allocated_bytes[TYPE_FREE];
+    size_t argument_lists;
+    size_t evals;
+    size_t calls;
+    size_t primitive_calls;
+    size_t native_compiles;
+    size_t deopts;
+    size_t depth;
+    size_t max_depth;
+} RuntimeStats;
+
+#define GC_DEFAULT_TRIGGER (1024 * 1024)
+#define GC_DEFAULT_HEAP_MAX 0
+
+// pins a local Object* variable for the collector of the interpreter named
+// interp in the enclosing function; pair with GC_UNPROTECT or restore a saved
+// root count before the variable goes out of scope
+#define GC_PROTECT(x) gc_push_root(interp, &(x))
+#define GC_UNPROTECT(n) (interp->gc.num_roots -= (n))
+
+// registers of the analyzed-tree evaluator's trampoline; profile_depth is
+// the profiler's stack depth when the trampoline started
+typedef struct ExecState {
+    Object* node;
+    Object* env;
+    size_t profile_depth;
+} ExecState;
+
+typedef enum Opcode {
+    OP_CONST,              // k          push consts[k]
+    OP_LOOKUP,             // k          push the value of symbol consts[k], by name
+    OP_LOCAL,              // d i        push slot i of the frame d levels up
+    OP_GLOBAL,             // k          push the global value of symbol consts[k]
+    OP_SET_LOCAL,          // d i        store top in a bound local, replace top with ok
+    OP_SET_GLOBAL,         // k
+    OP_SET_NAME,           // k
+    OP_DEFINE_LOCAL,       // d i        store top in a local, replace top with ok
+    OP_DEFINE_GLOBAL,      // k
+    OP_DEFINE_NAME,        // k
+    OP_POP,
+    OP_JUMP,               // target
+    OP_JUMP_IF_FALSE,      // target     pop, jump if #f
+    OP_JUMP_UNLESS_TRUE,   // target     pop, jump unless #t (cond clauses)
+    OP_CLOSURE,            // k          push a procedure for code consts[k]
+    OP_CALL,               // n          call the procedure under n arguments
+    OP_TAIL_CALL,          // n          same, reusing the current call frame
+    OP_CALL_GLOBAL,        // k n c      call the global value of symbol consts[k]
+                           //            with the n arguments on top, through cache c
+    OP_TAIL_CALL_GLOBAL,   // k n c
+    OP_APPLY,              //            spread the list on top and call
+    OP_TAIL_APPLY,
+    OP_INLINE,             // k p op     if symbol consts[k] holds primitive consts[p], run
+                           //            inline operation op on the arguments on top,
+                           //            else call the symbol's value
+    OP_TAIL_INLINE,
+    OP_FOLDED,             // k p v target
+                           //            if consts[k] holds consts[p], push consts[v]
+                           //            and jump
+    OP_RETURN
+} Opcode;
+
+// the procedure a call site found in a global, already checked to be
+// callable with the site's argument count; valid while epoch is the
+// heap's global epoch
+typedef struct CallCache {
+    Object* proc;
+    size_t epoch;
+} CallCache;
+
+typedef struct Compiler {
+    int32_t* instrs;
+    int num_instrs;
+    int instrs_capacity;
+    Object** consts;
+    int num_consts;
+    int consts_capacity;
+    int num_caches;
+    // enclosing compilers, whose constants are GC roots until they finish
+    struct Compiler* parent;
+} Compiler;
+
+typedef struct CallFrame {
+    Object* code;
+    int32_t* pc;
+    Object* env;
+    size_t profile_depth;
+} CallFrame;
+
+#define VM_STACK_MAX (1024 * 1024)
+#define VM_FRAMES_MAX (256 * 1024)
+
+// base is the number of frames below those of the innermost vm_run,
+// native_depth the number of native runs under way
+typedef struct VMState {
+    Object** stack;
+    Object** sp;
+    CallFrame* frames;
+    size_t num_frames;
+    size_t base;
+    int native_depth;
+} VMState;
+
+// procedures entered this many times have their code translated to native
+#define JIT_THRESHOLD 100
+// set in the instruction address a native run returns when an inlining guard
+// failed, which discards the native code
+#define JIT_DEOPT 0x1
+// code whose native code was dropped this many times stays on the VM
+#define JIT_MAX_DEOPTS 4
+
+// machine code for a code object: offsets holds where each instruction
+// starts, by index in instrs
+typedef struct NativeCode {
+    uint8_t* memory;
+    size_t size;
+    uint32_t* offsets;
+    struct NativeCode* next;
+} NativeCode;
+
+// runs native code from address, following calls and returns into other
+// native code, until an instruction it leaves to the VM; returns that
+// instruction's address, or NULL to carry on at the top frame's pc
+typedef int32_t* (*NativeEntry)(struct Interp* interp, CallFrame* frame, uint8_t* address);
+
+// where native code goes on after a call or return it made: address in the
+// native code of frame, or NULL to leave frame to the VM
+typedef struct NativeJump {
+    uint8_t* address;
+    CallFrame* frame;
+} NativeJump;
+
+typedef enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 } Reg;
+
+// a rel32 field waiting for its destination: the code of instruction target,
+// or with exit set a stub that leaves to the VM at that instruction
+typedef struct JitFixup {
+    size_t at;
+    int target;
+    bool exit;
+    bool deopt;
+} JitFixup;
+
+typedef struct Assembler {
+    uint8_t* bytes;
+    size_t size;
+    size_t capacity;
+    uint32_t* offsets;
+    JitFixup* fixups;
+    int num_fixups;
+    int fixups_capacity;
+} Assembler;
+
+// writes the reachable heap as an image: objects are numbered in the order
+// they are reached, index maps an object's address to its number; a fasl
+// file leaves out the values of symbols
+typedef struct ImageWriter {
+    bool symbol_values;
+    Object** objects;
+    size_t num_objects;
+    size_t objects_capacity;
+    Object** index_keys;
+    size_t* index_values;
+    size_t index_capacity;
+    uint64_t* words;
+    size_t num_words;
+    size_t words_capacity;
+} ImageWriter;
+
+#define IMAGE_MAGIC 0x4547414d49535342ull // "BSSIMAGE"
+#define IMAGE_VERSION 4
+// pointer fields hold immediates as they are, object k as (k + 1) << 3 and
+// objects that init creates (global_env, the or temporary) tagged like this
+#define IMAGE_TAG_BUILTIN 0x4
+
+#define FASL_MAGIC 0x004c534146535342ull // "BSSFASL"
+#define FASL_VERSION 2
+
+// calling context tree: one node per distinct stack of procedure labels,
+// holding the calls and exclusive time spent with that stack
+typedef struct ProfileNode {
+    const char* label;
+    struct ProfileNode* parent;
+    struct ProfileNode* children;
+    struct ProfileNode* next;
+    uint64_t calls;
+    uint64_t exclusive_ns;
+    // filled in by the report
+    uint64_t total_ns;
+    bool outermost;
+} ProfileNode;
+
+// an active procedure on the profiler's shadow stack
+typedef struct ProfileEntry {
+    ProfileNode* node;
+    uint64_t start_ns;
+    uint64_t child_ns;
+} ProfileEntry;
+
+// per label totals for the report; inclusive time counts only the outermost
+// activation of a recursive procedure
+typedef struct ProfileStat {
+    const char* label;
+    uint64_t calls;
+    uint64_t inclusive_ns;
+    uint64_t exclusive_ns;
+    int active;
+} ProfileStat;
+
+typedef struct Profiler {
+    bool enabled;
+    char* filename;
+    ProfileNode root;
+    ProfileEntry* stack;
+    size_t depth;
+    size_t capacity;
+} Profiler;
+
+typedef enum Engine {
+    ENGINE_VM,
+    ENGINE_ANALYZE
+} Engine;
+
+typedef enum TaskKind {
+    TASK_CALL,          // call a thunk
+    TASK_MAP,           // call proc on each of args, collecting the values
+    TASK_FOR_EACH       // same, for effect
+} TaskKind;
+
+typedef enum TaskState {
+    TASK_QUEUED,
+    TASK_RUNNING,
+    TASK_DONE
+} TaskState;
+
+// futures queued for one worker: it pushes and pops at the bottom, others
+// steal from the top
+typedef struct Deque {
+    pthread_mutex_t lock;
+    Object** futures;
+    size_t capacity;
+    size_t top;
+    size_t bottom;
+} Deque;
+
+// the worker threads of one heap, started by its first task; queued counts
+// deque entries, idle workers wait on work while it is zero, and done is
+// signalled whenever a task finishes
+typedef struct Pool {
+    int num_workers;
+    bool started;
+    bool shutdown;
+    struct Interp** workers;
+    pthread_t* threads;
+    Deque* deques;
+    size_t next_deque;
+    size_t queued;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+} Pool;
+
+#define DEQUE_MIN_CAPACITY 64
+// pmap splits its list into up to this many tasks per worker
+#define PMAP_TASKS_PER_WORKER 4
+
+// a client of -serve: the bytes it has sent that do not yet make up a
+// whole request, the answers it has not yet taken, and whether it has
+// closed its end
+typedef struct Connection {
+    int fd;
+    char* buf;
+    size_t len;
+    size_t capacity;
+    char* out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_capacity;
+    bool closed;
+} Connection;
+
+// a connection is not read from while this much of its output is unsent,
+// so a client that sends without reading holds back only itself
+#define SERVE_OUTPUT_MAX (64 * 1024)
+
+// what the threads of one interpreter share: the chunks, the collector's
+// state, the symbol table and the worker pool. lock guards the chunk lists
+// and counts and the thread list; running counts the threads that are not
+// parked for a collection or blocked between gc_leave and gc_enter, and a
+// collector waits on stopped for it to drop to one. code_lock serializes
+// call cache fills and changes to native code.
+typedef struct Heap {
+    pthread_mutex_t lock;
+    Chunk* chunks;
+    Chunk* partial[NUM_SIZE_CLASSES];
+    size_t num_chunks;
+    size_t bytes_reserved;
+
+    size_t num_objects;
+    size_t bytes_allocated;
+    size_t bytes_live;
+    size_t max_live_bytes;
+    size_t next_collection;
+    size_t heap_max;
+    size_t trigger;
+    size_t collections;
+
+    Object** mark_stack;
+    size_t mark_top;
+    size_t mark_capacity;
+
+    struct Interp* threads;
+    int num_threads;
+    int running;
+    bool stopping;
+    pthread_cond_t stopped;
+    pthread_cond_t resumed;
+
+    pthread_mutex_t symbols_lock;
+    SymbolTable symbols;
+    // advanced whenever a global holding a procedure changes, which
+    // invalidates every call site cache
+    size_t global_epoch;
+
+    pthread_mutex_t code_lock;
+    // native code replaced while a native run may still be in it
+    struct NativeCode* discarded;
+    Pool pool;
+} Heap;
+
+// one thread's view of an interpreter: the shared heap and global
+// environment, and its own allocation state, stacks, compilers, profiler
+// and counters. init makes the first; each pool worker gets a copy with
+// fresh per-thread state, and worker is its deque, or -1 off the pool.
+// out takes the values printed at top level: stdout, or the answer to the
+// -serve request being run.
+typedef struct Interp {
+    Heap* heap;
+    struct Interp* next_thread;
+    int worker;
+    FILE* out;
+    GCState gc;
+    Object* global_env;
+
+    Object* quote_symbol;
+    Object* define_symbol;
+    Object* set_symbol;
+    Object* ok_symbol;
+    Object* if_symbol;
+    Object* lambda_symbol;
+    Object* cond_symbol;
+    Object* else_symbol;
+    Object* apply_symbol;
+    Object* let_symbol;
+    Object* begin_symbol;
+    Object* let_star_symbol;
+    Object* letrec_symbol;
+    Object* and_symbol;
+    Object* or_symbol;
+    Object* or_temp_symbol;
+    Object* inline_symbol;
+    // the object init made for each entry of the primitive table, which
+    // images refer to by index, ended by NULL
+    Object** primitive_objects;
+
+    bool optimize;
+    bool jit;
+    Engine engine;
+    VMState vm;
+    Compiler* compilers;
+    Profiler profiler;
+    RuntimeStats counters;
+} Interp;
+
+#define ERROR_MESSAGE_MAX 256
+// room left on a thread's C stack for reporting that it is about to overflow
+#define STACK_MARGIN (256 * 1024)
+
+// where raise_error unwinds to, with how far the interpreter's roots, VM
+// stack, compilers and profiler had got when the handler was installed
+typedef struct ErrorHandler {
+    jmp_buf env;
+    struct ErrorHandler* prev;
+    Interp* interp;
+    size_t num_roots;
+    int held;
+    Object** sp;
+    size_t num_frames;
+    size_t base;
+    int native_depth;
+    Compiler* compilers;
+    size_t profile_depth;
+    size_t depth;
+    char message[ERROR_MESSAGE_MAX];
+} ErrorHandler;
+
+void install_handler(Interp* interp, ErrorHandler* handler);
+void remove_handler(ErrorHandler* handler);
+void init_stack_limit();
+Interp* new_interp();
+void init(Interp* interp);
+void free_interp(Interp* interp);
+void lex_open_file(LexState* ls, FILE* file);
+void lex_close(LexState* ls);
+Object* parse_exp(Interp* interp, LexState* ls);
 void print_object(Object* obj);
-Object* eval(Object* exp, Object* env);
-Object* apply(Object* proc, Object* args);
-void eval_all(LexState* ls, bool verbose);
+void write_object(FILE* stream, Object* obj);
+Object* eval(Interp* interp, Object* exp, Object* env);
+Object* apply(Interp* interp, Object* proc, Object* args);
+void eval_all(Interp* interp, LexState* ls, bool verbose);
+void load_file(Interp* interp, char* filename);
+Object* spawn_future(Interp* interp, Object* thunk);
+Object* touch_future(Interp* interp, Object* future);
+Object* parallel_map(Interp* interp, Object* proc, Object* list, TaskKind kind);
+void pool_stop(Interp* interp);
+void gc_leave(Interp* interp);
+void gc_enter(Interp* interp);
+void free_native(NativeCode* native);
+void free_discarded(Heap* heap);
+void profile_unwind(Interp* interp, size_t depth);
 
 #endif
\ No newline at end of file
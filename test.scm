@@ -23,6 +23,7 @@
 '(0 1)
 '(0 . (1 . ()))
 '(0 . (1 . 2))
+'((0 . (1 2)) read-after-dot)
 '(1 2 3)
 '(12 -34 #t ab "cd" (1 . 2) (1 2 3))
 'x
@@ -87,6 +88,32 @@ f
       (y (- 5 2)))
   (+ x y))
 
+"internal define and set!"
+(define (scale x)
+  (define factor 3)
+  (define (times y) (* factor y))
+  (times x))
+(scale 5)
+(define counter 0)
+(define (bump!) (set! counter (+ counter 1)) counter)
+(bump!)
+(bump!)
+
+"derived forms"
+(let* ((x 2)
+       (y (* x 3)))
+  (+ x y))
+(letrec ((even? (lambda (n) (if (= n 0) #t (odd? (- n 1)))))
+         (odd? (lambda (n) (if (= n 0) #f (even? (- n 1))))))
+  (even? 10))
+(and 1 2 3)
+(and 1 #f 3)
+(or #f 2)
+(or #f #f)
+(begin (bump!) (bump!))
+(cond ((= counter 4) (bump!) (bump!))
+      (else 0))
+
 "sicp interpreter"
 
 ;; Runs the Scheme code for the SICP evaluator, which defines the procedure eval-expr,
@@ -111,3 +138,46 @@ f
 (eval-expr '(define fact (Y fact-gen)) global-env)
 
 (eval-expr '(fact 5) global-env)
+
+"futures"
+(define (square x) (* x x))
+(define fut (future (lambda () (factorial 5))))
+(touch fut)
+(pmap square '(1 2 3 4 5))
+(parallel-for-each square '(1 2 3))
+(touch (future bump!))
+counter
+(touch (touch (future (lambda () (future (lambda () counter))))))
+
+"inlining"
+(define (first p) (car p))
+(first '(1 2))
+(define old-car car)
+(define (car p) 'redefined)
+(first '(1 2))
+(define car old-car)
+(first '(1 2))
+(if #f (car '()) 'dead)
+;; folded tests drop their dead branch and folded arguments fold their
+;; caller, so redefining = and * later reaches neither (-no-optimize
+;; prints dropped and 1)
+(define (pick) (if (= 1 1) 'kept 'dropped))
+(define (seven) (+ (* 2 3) 1))
+(define old= =)
+(define old* *)
+(define (= a b) #f)
+(define (* a b) 0)
+(pick)
+(seven)
+(define = old=)
+(define * old*)
+
+"native code"
+(define (inc x) (+ x 1))
+(define (run n) (if (= n 0) (inc 0) (begin (inc n) (run (- n 1)))))
+(run 200)
+(define old+ +)
+(define (+ a b) (old+ (old+ a b) 1000))
+(run 200)
+(define + old+)
+(run 200)